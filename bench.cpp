@@ -0,0 +1,379 @@
+// MIT License : Copyright (c) 2024 Yukiyoshi Sasao
+// Benchmark of kinfu TSDF volumes.
+// Integrates and ray-casts the same recorded (OrbbecKinfu -rec) or synthetic depth sequence
+// into OpenCV's and the native volumes at the same fixed camera poses, each in its own process,
+// and reports their time and memory. The full kinfu pipeline with each volume is also run for reference.
+#include <functional>
+#include <iostream>
+#include <sstream>
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "kinfu_config.h"
+#include "kinfu_sequence.h"
+#include "native_kinfu.h"
+
+static const char* VolumeEngineStr[] = {
+	"OpenCV",
+	"native",
+	"native16",
+};
+
+// volume only, at fixed poses
+struct VOLUME_RESULT_T {
+	bool b_valid;
+	double integrate_ms;	// average of integrate()
+	double raycast_ms;		// average of raycast()
+	double volume_mb;		// voxel storage
+	double rss_mb;			// peak RSS increase, <0 : not available
+};
+
+// full kinfu pipeline
+struct PIPELINE_RESULT_T {
+	bool b_valid;
+	double update_ms;	// average of update()
+	double render_ms;	// average of render()
+	int icp_fail;
+	double drift;		// RMS of the translation error [m], <0 : not available
+};
+
+#ifndef _WIN32
+// resident set size or its peak in MB from /proc/self/status
+static double readProcStatusMB(const char* key)
+{
+	FILE* fp = fopen("/proc/self/status", "r");
+	if(!fp) return -1;
+	char line[256];
+	double mb = -1;
+	while(fgets(line, sizeof(line), fp)){
+		if(0==strncmp(line, key, strlen(key))){
+			mb = atof(line + strlen(key)) / 1024.;	// kB
+			break;
+		}
+	}
+	fclose(fp);
+	return mb;
+}
+
+static bool readAll(int fd, void* buf, size_t size)
+{
+	char* p = (char*)buf;
+	while(size > 0){
+		ssize_t n = read(fd, p, size);
+		if(n <= 0) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+#endif
+
+// runs fn in a child process, so that the memory of one run does not affect the others,
+// and returns the results fn has produced
+template<typename T>
+static bool runInChild(const std::function<void(std::vector<T>&)>& fn, std::vector<T>& results)
+{
+	results.clear();
+#ifdef _WIN32
+	fn(results);
+	return true;
+#else
+	int fd[2];
+	if(pipe(fd) != 0){
+		perror("pipe");
+		return false;
+	}
+	pid_t pid = fork();
+	if(pid < 0){
+		perror("fork");
+		close(fd[0]);
+		close(fd[1]);
+		return false;
+	}
+	if(pid == 0){
+		close(fd[0]);
+		std::vector<T> r;
+		fn(r);
+		const size_t n = r.size();
+		bool b_ok = write(fd[1], &n, sizeof(n)) == (ssize_t)sizeof(n);
+		if(b_ok && n > 0) b_ok = write(fd[1], r.data(), n * sizeof(T)) == (ssize_t)(n * sizeof(T));
+		close(fd[1]);
+		_exit(b_ok ? 0 : -1);
+	}
+	close(fd[1]);
+	size_t n = 0;
+	bool b_ok = readAll(fd[0], &n, sizeof(n));
+	if(b_ok){
+		results.resize(n);
+		if(n > 0) b_ok = readAll(fd[0], results.data(), n * sizeof(T));
+	}
+	close(fd[0]);
+	waitpid(pid, NULL, 0);
+	if(!b_ok) results.clear();
+	return b_ok;
+#endif
+}
+
+// depth as float multiplied by scale, truncated in the same way as kinfu
+static cv::Mat toFloatDepth(const cv::Mat& depth, const cv::kinfu::Params& p, float scale)
+{
+	cv::Mat d;
+	depth.convertTo(d, CV_32F, scale);
+	if(p.truncateThreshold > 0){
+		cv::threshold(d, d, p.truncateThreshold * p.depthFactor * scale, 0, cv::THRESH_TOZERO_INV);
+	}
+	return d;
+}
+
+template<class Traits>
+static void runNativeVolume(const cv::kinfu::Params& p, const std::vector<cv::Mat>& depths,
+	const std::vector<cv::Affine3f>& poses, VOLUME_RESULT_T& r)
+{
+	TsdfBrickVolume<Traits> volume(p.voxelSize, p.volumeDims, p.volumePose,
+		p.tsdf_trunc_dist, p.tsdf_max_weight, p.raycast_step_factor);
+	cv::TickMeter tmIntegrate, tmRaycast;
+	cv::Mat points, normals;
+	for(size_t i=0; i<depths.size(); i++){
+		cv::Mat depth = toFloatDepth(depths[i], p, 1.f / p.depthFactor);	// meters
+		tmIntegrate.start();
+		volume.integrate(depth, poses[i], p.intr);
+		tmIntegrate.stop();
+		tmRaycast.start();
+		volume.raycast(poses[i], p.intr, p.frameSize, points, normals);
+		tmRaycast.stop();
+	}
+	r.integrate_ms = tmIntegrate.getTimeMilli() / std::max(1, (int)tmIntegrate.getCounter());
+	r.raycast_ms = tmRaycast.getTimeMilli() / std::max(1, (int)tmRaycast.getCounter());
+	r.volume_mb = volume.getMemoryBytes() / (1024. * 1024.);
+}
+
+static VOLUME_RESULT_T runVolume(const cv::kinfu::Params& p, int volume_engine,
+	const std::vector<cv::Mat>& depths, const std::vector<cv::Affine3f>& poses)
+{
+	VOLUME_RESULT_T r = {false, 0, 0, 0, -1};
+#ifndef _WIN32
+	const double rss0 = readProcStatusMB("VmRSS:");
+#endif
+	try {
+		if(volume_engine == 1){
+			runNativeVolume<TsdfFloatTraits>(p, depths, poses, r);
+		}
+		else if(volume_engine == 2){
+			runNativeVolume<TsdfPacked16Traits>(p, depths, poses, r);
+		}
+		else{
+			cv::Ptr<cv::kinfu::Volume> volume = cv::kinfu::makeVolume(cv::kinfu::VolumeType::TSDF,
+				p.voxelSize, p.volumePose.matrix, p.raycast_step_factor, p.tsdf_trunc_dist,
+				p.tsdf_max_weight, p.truncateThreshold, p.volumeDims);
+			const cv::kinfu::Intr intr(p.intr);
+			cv::TickMeter tmIntegrate, tmRaycast;
+			cv::Mat points, normals;
+			for(size_t i=0; i<depths.size(); i++){
+				cv::Mat depth = toFloatDepth(depths[i], p, 1.f);	// raw units, as kinfu passes it
+				tmIntegrate.start();
+				volume->integrate(depth, p.depthFactor, poses[i].matrix, intr);
+				tmIntegrate.stop();
+				tmRaycast.start();
+				volume->raycast(poses[i].matrix, intr, p.frameSize, points, normals);
+				tmRaycast.stop();
+			}
+			r.integrate_ms = tmIntegrate.getTimeMilli() / std::max(1, (int)tmIntegrate.getCounter());
+			r.raycast_ms = tmRaycast.getTimeMilli() / std::max(1, (int)tmRaycast.getCounter());
+			// dense TsdfVoxel (int8 TSDF, uint8 weight) for all voxels
+			r.volume_mb = (double)p.volumeDims[0] * p.volumeDims[1] * p.volumeDims[2] * 2 / (1024. * 1024.);
+		}
+#ifndef _WIN32
+		r.rss_mb = readProcStatusMB("VmHWM:") - rss0;
+#endif
+		r.b_valid = true;
+	}
+	catch(cv::Exception& e){
+		fprintf(stderr, "%s : %s\n", VolumeEngineStr[volume_engine], e.what());
+	}
+	return r;
+}
+
+// poses : ground truth relative to the first frame, or empty. estimated : poses by kinfu, optional
+static PIPELINE_RESULT_T runPipeline(const cv::Ptr<cv::kinfu::Params>& params, int volume_engine,
+	const std::vector<cv::Mat>& depths, const std::vector<cv::Affine3f>& poses, std::vector<cv::Matx44f>* estimated=NULL)
+{
+	PIPELINE_RESULT_T r = {false, 0, 0, 0, -1};
+	try {
+		cv::Ptr<cv::kinfu::KinFu> kf = createKinFu(params, volume_engine);
+		cv::TickMeter tmUpdate, tmRender;
+		double sq = 0;
+		for(size_t i=0; i<depths.size(); i++){
+			tmUpdate.start();
+			bool b_ok = kf->update(depths[i]);
+			tmUpdate.stop();
+			if(!b_ok){
+				r.icp_fail++;
+			}
+			else{
+				cv::Mat tsdfRender;
+				tmRender.start();
+				kf->render(tsdfRender);
+				tmRender.stop();
+			}
+			if(estimated) estimated->push_back(kf->getPose().matrix);
+			if(!poses.empty()){
+				cv::Vec3f e = kf->getPose().translation() - poses[i].translation();
+				sq += e.dot(e);
+			}
+		}
+		r.update_ms = tmUpdate.getTimeMilli() / std::max(1, (int)tmUpdate.getCounter());
+		r.render_ms = tmRender.getTimeMilli() / std::max(1, (int)tmRender.getCounter());
+		if(!poses.empty()) r.drift = std::sqrt(sq / depths.size());
+		r.b_valid = true;
+	}
+	catch(cv::Exception& e){
+		fprintf(stderr, "%s : %s\n", VolumeEngineStr[volume_engine], e.what());
+	}
+	return r;
+}
+
+void usage(int argc, char *argv[])
+{
+	printf("usage: %s [options]\n", argv[0]);
+	printf(" -seq [dir]           replay a sequence recorded by OrbbecKinfu -rec\n");
+	printf(" -n [nframes(100)]    frames of the synthetic sequence if -seq is not given\n");
+	printf(" -noise [noise(0.0015)]  synthetic depth noise sigma = noise * depth^2 [m]\n");
+	printf(" -kc                  coarse params\n");
+	printf(" -kp [file]           load kinfu params file\n");
+	printf(" -kv [volumes(0,1,2)] TSDF volumes to compare, 0:OpenCV, 1:native float (8B/voxel), 2:native 16bit (2B/voxel)\n");
+	printf(" -vo                  volume only, skip the full kinfu pipeline\n");
+	printf(" -t [threads(0)]      OpenCV threads, 0:default\n");
+	printf(" -clon                allow openCL (off by default to compare on CPU)\n");
+	printf(" \n");
+}
+
+int main(int argc, char *argv[])
+{
+	std::string seq_dir, kp_file;
+	int nframes = 100;
+	float noise = 0.0015f;
+	bool b_coarse = false;
+	std::vector<int> volume_engines = {0, 1, 2};
+	bool b_volume_only = false;
+	int n_threads = 0;
+	bool b_opencl_on = false;
+	for(int i=1; i<argc; i++){
+		if(0==strcmp(argv[i], "--help")){
+			usage(argc, argv);
+			exit(0);
+		}
+		else if(0==strcmp(argv[i], "-seq")){
+			seq_dir = argv[++i];
+		}
+		else if(0==strcmp(argv[i], "-n")){
+			nframes = atoi(argv[++i]);
+		}
+		else if(0==strcmp(argv[i], "-noise")){
+			noise = atof(argv[++i]);
+		}
+		else if(0==strcmp(argv[i], "-kc")){
+			b_coarse = true;
+		}
+		else if(0==strcmp(argv[i], "-kp")){
+			kp_file = argv[++i];
+		}
+		else if(0==strcmp(argv[i], "-kv")){
+			volume_engines.clear();
+			std::stringstream ss(argv[++i]);
+			std::string v;
+			while(std::getline(ss, v, ',')) volume_engines.push_back(std::min(2, std::max(0, atoi(v.c_str()))));
+		}
+		else if(0==strcmp(argv[i], "-vo")){
+			b_volume_only = true;
+		}
+		else if(0==strcmp(argv[i], "-t")){
+			n_threads = atoi(argv[++i]);
+		}
+		else if(0==strcmp(argv[i], "-clon")){
+			b_opencl_on = true;
+		}
+		else{
+			printf("unknown option %s\n", argv[i]);
+			exit(-1);
+		}
+	}
+
+	cv::Ptr<cv::kinfu::Params> params = b_coarse ? cv::kinfu::Params::coarseParams() : cv::kinfu::Params::defaultParams();
+	std::vector<cv::Mat> depths;
+	std::vector<cv::Affine3f> poses;
+	if(!seq_dir.empty()){
+		if(!loadSequence(seq_dir, *params, depths, poses)) exit(-1);
+	}
+	else{
+		params->frameSize = cv::Size(640, 480);
+		params->intr = cv::Matx33f(525.f, 0, 319.5f, 0, 525.f, 239.5f, 0, 0, 1);
+		params->depthFactor = 1000.f;
+		makeSyntheticSequence(*params, nframes, noise, depths, poses);
+	}
+	if(!kp_file.empty() && !loadKinfuParams(kp_file, *params)) exit(-1);
+	printf("volumeDims=(%d,%d,%d), voxelSize=%f, tsdf_trunc_dist=%f, pyramidLevels=%d\n",
+		params->volumeDims[0], params->volumeDims[1], params->volumeDims[2], params->voxelSize,
+		params->tsdf_trunc_dist, params->pyramidLevels);
+
+	// ground truth relative to the first frame, where kinfu starts
+	if(!poses.empty()){
+		const cv::Affine3f gt0inv = poses[0].inv();
+		for(size_t i=0; i<poses.size(); i++) poses[i] = gt0inv * poses[i];
+	}
+
+	// fixed poses for the volumes : the ground truth, or the poses of a reference OpenCV kinfu run
+	std::vector<cv::Affine3f> fixedPoses = poses;
+	if(fixedPoses.empty()){
+		std::vector<cv::Matx44f> estimated;
+		runInChild<cv::Matx44f>([&](std::vector<cv::Matx44f>& r){
+			if(n_threads > 0) cv::setNumThreads(n_threads);
+			cv::ocl::setUseOpenCL(b_opencl_on);
+			if(!runPipeline(params, 0, depths, poses, &r).b_valid) r.clear();
+		}, estimated);
+		if(estimated.size() != depths.size()){
+			fprintf(stderr, "reference kinfu run failed\n");
+			exit(-1);
+		}
+		for(const cv::Matx44f& m : estimated) fixedPoses.push_back(cv::Affine3f(m));
+		printf("poses : reference OpenCV kinfu run\n");
+	}
+	else{
+		printf("poses : ground truth\n");
+	}
+
+	printf("%-10s %13s %11s %10s %8s", "volume", "integrate[ms]", "raycast[ms]", "volume[MB]", "rss[MB]");
+	if(!b_volume_only) printf(" | %10s %10s %8s %9s", "update[ms]", "render[ms]", "icp_fail", "drift[m]");
+	printf("\n");
+	for(int engine : volume_engines){
+		std::vector<VOLUME_RESULT_T> vr;
+		runInChild<VOLUME_RESULT_T>([&](std::vector<VOLUME_RESULT_T>& r){
+			if(n_threads > 0) cv::setNumThreads(n_threads);
+			cv::ocl::setUseOpenCL(b_opencl_on);
+			r.push_back(runVolume(*params, engine, depths, fixedPoses));
+		}, vr);
+		if(vr.empty() || !vr[0].b_valid){
+			printf("%-10s failed\n", VolumeEngineStr[engine]);
+			continue;
+		}
+		printf("%-10s %13.2f %11.2f %10.1f %8.1f", VolumeEngineStr[engine],
+			vr[0].integrate_ms, vr[0].raycast_ms, vr[0].volume_mb, vr[0].rss_mb);
+		if(!b_volume_only){
+			std::vector<PIPELINE_RESULT_T> pr;
+			runInChild<PIPELINE_RESULT_T>([&](std::vector<PIPELINE_RESULT_T>& r){
+				if(n_threads > 0) cv::setNumThreads(n_threads);
+				cv::ocl::setUseOpenCL(b_opencl_on);
+				r.push_back(runPipeline(params, engine, depths, poses));
+			}, pr);
+			if(pr.empty() || !pr[0].b_valid){
+				printf(" | failed");
+			}
+			else{
+				printf(" | %10.2f %10.2f %8d %9.4f", pr[0].update_ms, pr[0].render_ms, pr[0].icp_fail, pr[0].drift);
+			}
+		}
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,86 @@
+// MIT License : Copyright (c) 2024 Yukiyoshi Sasao
+#pragma once
+#include <opencv2/opencv.hpp>
+#include <opencv2/rgbd.hpp>	// kinfu, colored_kinfu
+
+// kinfu params config file (cv::FileStorage, .yml/.xml/.json)
+// Only the keys found in a file are applied, others keep their current values.
+
+// place the volume in front of the camera in the same way as cv::kinfu::Params::defaultParams()
+template<typename T>
+static inline void centerKinfuVolume(T& p)
+{
+	const cv::Vec3f volSize = p.voxelSize * cv::Vec3f(p.volumeDims);
+	p.volumePose = cv::Affine3f().translate(cv::Vec3f(-volSize[0]/2.f, -volSize[1]/2.f, 0.5f));
+}
+
+template<typename T>
+static inline void saveKinfuParams(cv::FileStorage& fs, const T& p, bool b_camera=false)
+{
+	if(b_camera){
+		fs << "frameSize" << p.frameSize;
+		fs << "intr" << cv::Mat(p.intr);
+		fs << "depthFactor" << p.depthFactor;
+	}
+	fs << "bilateral_sigma_depth" << p.bilateral_sigma_depth;
+	fs << "bilateral_sigma_spatial" << p.bilateral_sigma_spatial;
+	fs << "bilateral_kernel_size" << p.bilateral_kernel_size;
+	fs << "pyramidLevels" << p.pyramidLevels;
+	fs << "volumeDims" << p.volumeDims;
+	fs << "voxelSize" << p.voxelSize;
+	fs << "tsdf_min_camera_movement" << p.tsdf_min_camera_movement;
+	fs << "tsdf_trunc_dist" << p.tsdf_trunc_dist;
+	fs << "tsdf_max_weight" << p.tsdf_max_weight;
+	fs << "raycast_step_factor" << p.raycast_step_factor;
+	fs << "icpDistThresh" << p.icpDistThresh;
+	fs << "icpAngleThresh" << p.icpAngleThresh;
+	fs << "icpIterations" << p.icpIterations;
+	fs << "truncateThreshold" << p.truncateThreshold;
+}
+
+template<typename V>
+static inline bool readKinfuParam(const cv::FileNode& fn, const char* name, V& v)
+{
+	if(fn[name].empty()) return false;
+	fn[name] >> v;
+	return true;
+}
+
+template<typename T>
+static inline void readKinfuParams(const cv::FileNode& fn, T& p)
+{
+	readKinfuParam(fn, "frameSize", p.frameSize);
+	cv::Mat intr;
+	if(readKinfuParam(fn, "intr", intr)){
+		intr.convertTo(intr, CV_32F);
+		p.intr = cv::Matx33f((const float*)intr.ptr());
+	}
+	readKinfuParam(fn, "depthFactor", p.depthFactor);
+	readKinfuParam(fn, "bilateral_sigma_depth", p.bilateral_sigma_depth);
+	readKinfuParam(fn, "bilateral_sigma_spatial", p.bilateral_sigma_spatial);
+	readKinfuParam(fn, "bilateral_kernel_size", p.bilateral_kernel_size);
+	readKinfuParam(fn, "pyramidLevels", p.pyramidLevels);
+	bool b_volume = readKinfuParam(fn, "volumeDims", p.volumeDims);
+	b_volume |= readKinfuParam(fn, "voxelSize", p.voxelSize);
+	if(b_volume) centerKinfuVolume(p);
+	readKinfuParam(fn, "tsdf_min_camera_movement", p.tsdf_min_camera_movement);
+	readKinfuParam(fn, "tsdf_trunc_dist", p.tsdf_trunc_dist);
+	readKinfuParam(fn, "tsdf_max_weight", p.tsdf_max_weight);
+	readKinfuParam(fn, "raycast_step_factor", p.raycast_step_factor);
+	readKinfuParam(fn, "icpDistThresh", p.icpDistThresh);
+	readKinfuParam(fn, "icpAngleThresh", p.icpAngleThresh);
+	readKinfuParam(fn, "icpIterations", p.icpIterations);
+	readKinfuParam(fn, "truncateThreshold", p.truncateThreshold);
+}
+
+template<typename T>
+static inline bool loadKinfuParams(const std::string& filename, T& p)
+{
+	cv::FileStorage fs(filename, cv::FileStorage::READ);
+	if(!fs.isOpened()){
+		fprintf(stderr, "cannot open kinfu params %s\n", filename.c_str());
+		return false;
+	}
+	readKinfuParams(fs.root(), p);
+	return true;
+}
@@ -0,0 +1,78 @@
+// MIT License : Copyright (c) 2024 Yukiyoshi Sasao
+#pragma once
+#include <opencv2/highgui.hpp>
+
+// Decides when kinfu render() runs.
+// render(image) shades the points/normals which the last update() has ray-casted for ICP,
+// so it is rendered only when its window is shown (not hidden by toggleShow() nor closed), and at most max_fps.
+// The time saved by skipped renders is estimated from the average render time,
+// so nothing is counted until the first render has been measured.
+class KinfuRenderScheduler
+{
+public:
+	KinfuRenderScheduler(const std::string& _winname, double _max_fps=0){
+		winname = _winname;
+		max_fps = _max_fps;
+		b_show = true;
+		b_opened = false;
+		last_ms = -1;
+		render_ms = 0;
+		saved_ms = 0;
+		n_frames = 0;
+	}
+
+	// shows again also a window closed by the user
+	void toggleShow(){
+		b_show = !isDisplayed();
+		b_opened = false;	// render once to (re)open the window
+	}
+	bool isShown() const {
+		return isDisplayed();
+	}
+
+	// call once per successful kinfu update
+	bool due(double now_ms){
+		n_frames++;
+		bool b_due = isDisplayed() && (max_fps <= 0 || last_ms < 0 || now_ms - last_ms >= 1000. / max_fps);
+		if(!b_due) saved_ms += render_ms;
+		return b_due;
+	}
+	// call after render() and showing it in the window
+	void rendered(double start_ms, double elapsed_ms){
+		b_opened = true;
+		last_ms = start_ms;
+		render_ms = (render_ms == 0) ? elapsed_ms : 0.9 * render_ms + 0.1 * elapsed_ms;
+	}
+
+	bool isMeasured() const {
+		return render_ms > 0;
+	}
+	double getRenderMsec() const {
+		return render_ms;
+	}
+	double getSavedMsecPerFrame() const {
+		return n_frames ? saved_ms / n_frames : 0;
+	}
+
+private:
+	std::string winname;
+	double max_fps;		// 0: every frame
+	bool b_show;
+	bool b_opened;		// the window has been shown since toggleShow()
+	double last_ms;
+	double render_ms;	// moving average of a render, 0 until measured
+	double saved_ms;
+	int n_frames;
+
+	bool isDisplayed() const {
+		if(!b_show) return false;
+		if(!b_opened) return true;
+		// closed by the user
+		try {
+			return cv::getWindowProperty(winname, cv::WND_PROP_VISIBLE) > 0;
+		}
+		catch(cv::Exception&){
+			return false;
+		}
+	}
+};
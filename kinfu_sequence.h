@@ -0,0 +1,180 @@
+// MIT License : Copyright (c) 2024 Yukiyoshi Sasao
+#pragma once
+#include <cfloat>
+#include <opencv2/opencv.hpp>
+#include <opencv2/rgbd.hpp>	// kinfu, colored_kinfu
+#include "kinfu_config.h"
+
+// depth sequence for replaying kinfu offline
+//   <dir>/params.yml       kinfu params incl. frameSize, intr, depthFactor
+//   <dir>/depth_%06d.png   16bit depth frames
+//   <dir>/poses.yml        (optional) ground truth camera poses, e.g. of a synthetic sequence saved by OrbbecKinfuTune -save
+
+static inline std::string sequenceDepthPath(const std::string& dir, int idx)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/depth_%06d.png", idx);
+	return dir + name;
+}
+
+static inline bool saveSequenceParams(const std::string& dir, const cv::kinfu::Params& p)
+{
+	cv::FileStorage fs(dir + "/params.yml", cv::FileStorage::WRITE);
+	if(!fs.isOpened()){
+		fprintf(stderr, "cannot write %s/params.yml\n", dir.c_str());
+		return false;
+	}
+	saveKinfuParams(fs, p, true);
+	return true;
+}
+
+static inline bool saveSequenceDepth(const std::string& dir, int idx, const cv::Mat& depth)
+{
+	return cv::imwrite(sequenceDepthPath(dir, idx), depth);
+}
+
+static inline bool saveSequencePoses(const std::string& dir, const std::vector<cv::Affine3f>& poses)
+{
+	cv::FileStorage fs(dir + "/poses.yml", cv::FileStorage::WRITE);
+	if(!fs.isOpened()) return false;
+	fs << "poses" << "[";
+	for(auto& pose : poses) fs << cv::Mat(pose.matrix);
+	fs << "]";
+	return true;
+}
+
+static inline bool saveSequence(const std::string& dir, const cv::kinfu::Params& p,
+	const std::vector<cv::Mat>& depths, const std::vector<cv::Affine3f>& poses)
+{
+	if(!saveSequenceParams(dir, p)) return false;
+	for(size_t i=0; i<depths.size(); i++){
+		if(!saveSequenceDepth(dir, (int)i, depths[i])){
+			fprintf(stderr, "cannot write %s\n", sequenceDepthPath(dir, (int)i).c_str());
+			return false;
+		}
+	}
+	if(!poses.empty() && !saveSequencePoses(dir, poses)){
+		fprintf(stderr, "cannot write %s/poses.yml\n", dir.c_str());
+		return false;
+	}
+	printf("sequence saved to %s : %d frames%s\n", dir.c_str(), (int)depths.size(), poses.empty() ? "" : " with ground truth");
+	return true;
+}
+
+// p must be initialized (e.g. by defaultParams()) before, params.yml overrides it.
+static inline bool loadSequence(const std::string& dir, cv::kinfu::Params& p,
+	std::vector<cv::Mat>& depths, std::vector<cv::Affine3f>& poses)
+{
+	if(!loadKinfuParams(dir + "/params.yml", p)) return false;
+	depths.clear();
+	for(int i=0; ; i++){
+		cv::Mat depth = cv::imread(sequenceDepthPath(dir, i), cv::IMREAD_ANYDEPTH);
+		if(depth.empty()) break;
+		if(depth.type() != CV_16UC1 || depth.size() != p.frameSize){
+			fprintf(stderr, "%s : unexpected depth type or size\n", sequenceDepthPath(dir, i).c_str());
+			return false;
+		}
+		depths.push_back(depth);
+	}
+	poses.clear();
+	cv::FileStorage fs(dir + "/poses.yml", cv::FileStorage::READ);
+	if(fs.isOpened()){
+		cv::FileNode node = fs["poses"];
+		for(auto it = node.begin(); it != node.end(); ++it){
+			cv::Mat m;
+			*it >> m;
+			m.convertTo(m, CV_32F);
+			poses.push_back(cv::Affine3f(m));
+		}
+		if(poses.size() != depths.size()){
+			fprintf(stderr, "poses.yml has %d poses for %d frames, ignored\n", (int)poses.size(), (int)depths.size());
+			poses.clear();
+		}
+	}
+	printf("sequence %s : %d frames%s\n", dir.c_str(), (int)depths.size(), poses.empty() ? "" : " with ground truth");
+	return !depths.empty();
+}
+
+//// synthetic sequence
+// A camera moves along a closed loop inside a room (floor, 3 walls) with a sphere and a box,
+// so that ICP is constrained in all directions. Frame 0 is the identity pose.
+static inline float raySphere(const cv::Vec3f& o, const cv::Vec3f& d, const cv::Vec3f& c, float r)
+{
+	cv::Vec3f oc = o - c;
+	float a = d.dot(d), b = oc.dot(d), k = oc.dot(oc) - r*r;
+	float disc = b*b - a*k;
+	if(disc < 0) return -1;
+	return (-b - std::sqrt(disc)) / a;
+}
+static inline float rayBox(const cv::Vec3f& o, const cv::Vec3f& d, const cv::Vec3f& bmin, const cv::Vec3f& bmax)
+{
+	float tmin = -FLT_MAX, tmax = FLT_MAX;
+	for(int k=0; k<3; k++){
+		if(std::abs(d[k]) < 1e-9f){
+			if(o[k] < bmin[k] || o[k] > bmax[k]) return -1;
+			continue;
+		}
+		float t0 = (bmin[k] - o[k]) / d[k], t1 = (bmax[k] - o[k]) / d[k];
+		if(t0 > t1) std::swap(t0, t1);
+		tmin = std::max(tmin, t0);
+		tmax = std::min(tmax, t1);
+	}
+	return (tmin <= tmax && tmin > 0) ? tmin : -1;
+}
+
+static inline cv::Affine3f syntheticPose(int idx, int nframes)
+{
+	const float s = 2.f * (float)CV_PI * idx / nframes;
+	cv::Vec3f t(0.15f * std::sin(s), 0.05f * std::sin(2*s), 0.1f * (1.f - std::cos(s)));
+	cv::Vec3f r(0.03f * std::sin(2*s), 0.10f * std::sin(s), 0.f);
+	return cv::Affine3f(r, t);
+}
+
+static inline void makeSyntheticSequence(const cv::kinfu::Params& p, int nframes, float noise,
+	std::vector<cv::Mat>& depths, std::vector<cv::Affine3f>& poses)
+{
+	// room in the first camera coordinates (x:right, y:down, z:forward) [m]
+	const float wall_x = 1.4f, floor_y = 0.9f, back_z = 3.2f;
+	const cv::Vec3f sphere_c(0.35f, 0.3f, 2.0f);
+	const float sphere_r = 0.35f;
+	const cv::Vec3f box_min(-0.8f, 0.4f, 1.8f), box_max(-0.2f, floor_y, 2.5f);
+
+	const float fx = p.intr(0,0), fy = p.intr(1,1), cx = p.intr(0,2), cy = p.intr(1,2);
+	cv::RNG rng(0x1234);
+	depths.clear();
+	poses.clear();
+	for(int i=0; i<nframes; i++){
+		cv::Affine3f pose = syntheticPose(i, nframes);
+		const cv::Matx33f R = pose.rotation();
+		const cv::Vec3f o = pose.translation();
+		cv::Mat depth(p.frameSize, CV_16UC1);
+		for(int y=0; y<depth.rows; y++){
+			uint16_t* pdata = depth.ptr<uint16_t>(y);
+			for(int x=0; x<depth.cols; x++){
+				// z of the camera ray is 1, so the hit distance t is the depth
+				const cv::Vec3f d = R * cv::Vec3f((x - cx) / fx, (y - cy) / fy, 1.f);
+				float t = FLT_MAX;
+				for(int k=0; k<3; k++){
+					const float plane = (k == 0) ? (d[0] > 0 ? wall_x : -wall_x) : (k == 1 ? floor_y : back_z);
+					if(d[k] != 0){
+						float tk = (plane - o[k]) / d[k];
+						if(tk > 0) t = std::min(t, tk);
+					}
+				}
+				float ts = raySphere(o, d, sphere_c, sphere_r);
+				if(ts > 0) t = std::min(t, ts);
+				float tb = rayBox(o, d, box_min, box_max);
+				if(tb > 0) t = std::min(t, tb);
+				if(t == FLT_MAX){
+					*pdata++ = 0;
+					continue;
+				}
+				if(noise > 0) t += (float)rng.gaussian(noise * t * t);	// ToF/stereo-like noise grows with depth^2
+				*pdata++ = (t > 0) ? cv::saturate_cast<uint16_t>(t * p.depthFactor) : 0;
+			}
+		}
+		depths.push_back(depth);
+		poses.push_back(pose);
+	}
+	printf("synthetic sequence : %d frames, %dx%d, noise=%f\n", nframes, p.frameSize.width, p.frameSize.height, noise);
+}
@@ -10,6 +10,9 @@
 
 #include "orbbec_utils.h"
 #include "orbbec_cammat.h"
+#include "kinfu_sequence.h"
+#include "kinfu_render.h"
+#include "native_kinfu.h"
 
 template<typename T>
 static void get_and_show_point_clouds(T& kf, cv::viz::Viz3d& window,
@@ -59,8 +62,13 @@ struct APP_PARAMS_T {
 	int kinfu_show_mode;
 	bool b_opencl_off;
 	bool b_kinfu_reset_in_icp_fail;
+	int kinfu_volume;
 	
 	double show_scale;
+	double render_fps;
+	
+	std::string kinfu_params_file;
+	std::string record_dir;
 	
 	APP_PARAMS_T() : 
 		ob_align_mode(ALIGN_D2C_SW_MODE),	// 0:Disabled, 1:HW, 2:SW
@@ -78,8 +86,10 @@ struct APP_PARAMS_T {
 		kinfu_show_mode(0),		// 0: render, 1: +3D_View, 2: +normals
 		b_opencl_off(false),
 		b_kinfu_reset_in_icp_fail(false),
+		kinfu_volume(0),	// 0:OpenCV, 1:native float (8B/voxel), 2:native 16bit (2B/voxel)
 		
-		show_scale(0.5)
+		show_scale(0.5),
+		render_fps(0)		// max fps of kinfu render, 0: every frame
 		{}
 };
 
@@ -90,6 +100,7 @@ void usage_key()
 	printf("  s : save depth.ply in depth-kinfu, color.ply in colored-kinfu\n");
 	printf("  r : reset kinfu\n");
 	printf("  f : freeze 3D View / restore\n");
+	printf("  v : hide kinfu render (skip rendering) / show\n");
 	printf("  \n");
 }
 void usage(int argc, char *argv[], APP_PARAMS_T& par)
@@ -99,10 +110,14 @@ void usage(int argc, char *argv[], APP_PARAMS_T& par)
 	printf(" -k [kinfu_mode(%d)]  0:Disabled, 1:depth, 2:colored\n", par.kinfu_mode);
 	printf(" -kc                  coarse in colored kinfu\n");
 	printf(" -kr                  reset kinfu if ICP fails.\n");
+	printf(" -kv [kinfu_volume(%d)]  TSDF volume in depth kinfu, 0:OpenCV, 1:native float (8B/voxel), 2:native 16bit (2B/voxel)\n", par.kinfu_volume);
 	printf(" -ks [kinfu_show_mode(%d)]  0: render, 1: +3D_View, 2: +normals\n", par.kinfu_show_mode);
 	printf(" -md [max_depth_mm(%d)]  max depth in mm\n", par.max_depth_mm);
 	printf(" -cloff               set openCL off\n");
 	printf(" -ss [show_scale(%.2f)]  window show scale\n", par.show_scale);
+	printf(" -rf [render_fps(%.1f)]  max fps of kinfu render, 0: every frame\n", par.render_fps);
+	printf(" -kp [file]           load kinfu params file (e.g. by OrbbecKinfuTune)\n");
+	printf(" -rec [dir]           record depth sequence to an existing dir for OrbbecKinfuTune\n");
 	printf(" \n");
 	usage_key();
 }
@@ -128,6 +143,9 @@ try {
 		else if(0==strcmp(argv[i], "-kr")){
 			par.b_kinfu_reset_in_icp_fail = true;
 		}
+		else if(0==strcmp(argv[i], "-kv")){
+			par.kinfu_volume = atoi(argv[++i]);
+		}
 		else if(0==strcmp(argv[i], "-ks")){
 			par.kinfu_show_mode = atoi(argv[++i]);
 		}
@@ -137,6 +155,18 @@ try {
 		else if(0==strcmp(argv[i], "-cloff")){
 			par.b_opencl_off = true;
 		}
+		else if(0==strcmp(argv[i], "-ss")){
+			par.show_scale = atof(argv[++i]);
+		}
+		else if(0==strcmp(argv[i], "-rf")){
+			par.render_fps = atof(argv[++i]);
+		}
+		else if(0==strcmp(argv[i], "-kp")){
+			par.kinfu_params_file = argv[++i];
+		}
+		else if(0==strcmp(argv[i], "-rec")){
+			par.record_dir = argv[++i];
+		}
 		else{
 			printf("unknown option %s\n", argv[i]);
 			exit(-1);
@@ -210,14 +240,23 @@ try {
 
 	// prepare camera matrix
 	std::unique_ptr<OrbbecCameraMatrix> cam = std::unique_ptr<OrbbecCameraMatrix>(new OrbbecCameraMatrix(cameraParam, par.b_kinfu_coarse));
+	if(!par.kinfu_params_file.empty()){
+		if(!cam->loadKinfuParams(par.kinfu_params_file)) exit(-1);
+	}
+	if(!par.record_dir.empty()){
+		if(!saveSequenceParams(par.record_dir, *cam->getKinfuParams())) exit(-1);
+	}
 
 	// prepare kinfu
 	cv::Ptr<cv::kinfu::KinFu> kf;
 	if(par.kinfu_mode == 1){
-		kf = cv::kinfu::KinFu::create(cam->getKinfuParams());
+		kf = createKinFu(cam->getKinfuParams(), par.kinfu_volume);
 	}
 	cv::Ptr<cv::colored_kinfu::ColoredKinFu> kfc;
 	if(par.kinfu_mode == 2){
+		if(par.kinfu_volume != 0){
+			printf("native TSDF volume is for depth kinfu only, OpenCV's is used.\n");
+		}
 		kfc = cv::colored_kinfu::ColoredKinFu::create(cam->getColoredKinfuParams());
 		// Enables OpenCL explicitly (by default can be switched-off)
 		//cv::setUseOptimized(true);
@@ -239,6 +278,9 @@ try {
 	cv::UMat points, normals;
 	bool b_first = true;
 	bool b_pause_3dviz = false;
+	int record_idx = 0;
+	const char* renderWindowName = (par.kinfu_mode == 2) ? "colored_kinfu render" : "kinfu render";
+	KinfuRenderScheduler renderScheduler(renderWindowName, par.render_fps);
 	while(1) {
 		double t0 = gettimemsec();
 		auto frameSet = pipe.waitForFrames(par.ob_timeout_ms);
@@ -276,6 +318,11 @@ try {
 			bgr = convObFrame2CvMat(colorFrame.get());
 		}
 		cv::Mat depth = convObFrame2CvMat(depthFrame.get());
+		if(!par.record_dir.empty()){
+			if(!saveSequenceDepth(par.record_dir, record_idx++, depth)){
+				fprintf(stderr, "cannot record depth to %s\n", par.record_dir.c_str());
+			}
+		}
 
 		// undistortion
 		//cv::Mat undistort_depth, undistort_bgr;
@@ -288,6 +335,7 @@ try {
 		
 		double t2 = gettimemsec();
 		double t22=0, t23=0;
+		bool b_render_skipped = false;
 		// process kinfu
 		if(!kf.empty()){
 			if(!kf->update(depth)){
@@ -299,10 +347,16 @@ try {
 			}
 			else{
 				t22 = gettimemsec();
-				cv::Mat tsdfRender;
-				kf->render(tsdfRender);	// a 0-surface of TSDF using Phong shading
-				t23 = gettimemsec();
-				showColor("kinfu render", tsdfRender, par.show_scale);
+				if(renderScheduler.due(t22)){
+					cv::Mat tsdfRender;
+					kf->render(tsdfRender);	// a 0-surface of TSDF using Phong shading
+					t23 = gettimemsec();
+					renderScheduler.rendered(t22, t23 - t22);
+					showColor(renderWindowName, tsdfRender, par.show_scale);
+				}
+				else{
+					b_render_skipped = true;
+				}
 				
 				if(par.kinfu_show_mode > 0 && (!b_pause_3dviz)){
 					get_and_show_point_clouds(kf, window, points, normals, par.kinfu_show_mode);
@@ -321,10 +375,16 @@ try {
 			}
 			else{
 				t22 = gettimemsec();
-				cv::Mat tsdfRender;
-				kfc->render(tsdfRender);	// a 0-surface of TSDF using Phong shading
-				t23 = gettimemsec();
-				showColor("colored_kinfu render", tsdfRender, par.show_scale);
+				if(renderScheduler.due(t22)){
+					cv::Mat tsdfRender;
+					kfc->render(tsdfRender);	// a 0-surface of TSDF using Phong shading
+					t23 = gettimemsec();
+					renderScheduler.rendered(t22, t23 - t22);
+					showColor(renderWindowName, tsdfRender, par.show_scale);
+				}
+				else{
+					b_render_skipped = true;
+				}
 				
 				if(par.kinfu_show_mode > 0 && (!b_pause_3dviz)){
 					get_and_show_point_clouds(kfc, window, points, normals, par.kinfu_show_mode);
@@ -371,13 +431,29 @@ try {
 		if(key == 'f'){
 			b_pause_3dviz = !b_pause_3dviz;
 		}
+
+		if(key == 'v' && par.kinfu_mode != 0){
+			renderScheduler.toggleShow();
+			if(!renderScheduler.isShown()){
+				cv::destroyWindow(renderWindowName);
+			}
+		}
 		
 		b_first = false;
 		double t4 = gettimemsec();
 		printf("[msec] total:%d, cap:%d, pre:%d, kinfu:%d, show:%d\n",
 			(int)(t4-t0), (int)(t1-t0), (int)(t2-t1), (int)(t3-t2), (int)(t4-t3));
 		if(t22 != 0 && t23 != 0){
-			printf("  (kinfu-only:%d, render:%d)\n", (int)(t22-t2), (int)(t23-t22));
+			printf("  (kinfu-only:%d, render:%d, render saved/frame:%.1f)\n",
+				(int)(t22-t2), (int)(t23-t22), renderScheduler.getSavedMsecPerFrame());
+		}
+		else if(b_render_skipped && renderScheduler.isMeasured()){
+			printf("  (kinfu-only:%d, render:skipped(~%d), render saved/frame:%.1f)\n",
+				(int)(t22-t2), (int)renderScheduler.getRenderMsec(), renderScheduler.getSavedMsecPerFrame());
+		}
+		else if(b_render_skipped){
+			printf("  (kinfu-only:%d, render:skipped, render saved/frame:not measured until the first render)\n",
+				(int)(t22-t2));
 		}
 	}
 
@@ -0,0 +1,265 @@
+// MIT License : Copyright (c) 2024 Yukiyoshi Sasao
+#pragma once
+#include <opencv2/opencv.hpp>
+#include <opencv2/rgbd.hpp>	// kinfu, colored_kinfu
+#include "tsdf_brick_volume.h"
+
+// KinectFusion with the native brick TSDF volume (tsdf_brick_volume.h), as a cv::kinfu::KinFu.
+// It uses the same cv::kinfu::Params as OpenCV's KinFu:
+// bilateral filter, frame-to-model point-to-plane ICP on a pyramid, and TSDF integration/ray-casting.
+template<class Traits>
+class NativeKinFu : public cv::kinfu::KinFu
+{
+public:
+	NativeKinFu(const cv::kinfu::Params& _params) :
+		params(_params),
+		volume(_params.voxelSize, _params.volumeDims, _params.volumePose,
+			_params.tsdf_trunc_dist, _params.tsdf_max_weight, _params.raycast_step_factor)
+	{
+		CV_Assert((int)params.icpIterations.size() == params.pyramidLevels);
+		reset();
+	}
+
+	const cv::kinfu::Params& getParams() const override {
+		return params;
+	}
+
+	// a 0-surface of TSDF using Phong shading, from the last ray-casting of update()
+	void render(cv::OutputArray image) const override {
+		renderPointsNormals(modelPoints[0], modelNormals[0], image, params.lightPose);
+	}
+	void render(cv::OutputArray image, const cv::Matx44f& cameraPose) const override {
+		cv::Mat points, normals;
+		volume.raycast(cv::Affine3f(cameraPose), params.intr, params.frameSize, points, normals);
+		renderPointsNormals(points, normals, image, params.lightPose);
+	}
+
+	void getCloud(cv::OutputArray points, cv::OutputArray normals) const override {
+		volume.fetchPointsNormals(points, normals);
+	}
+	void getPoints(cv::OutputArray points) const override {
+		volume.fetchPointsNormals(points, cv::noArray());
+	}
+	void getNormals(cv::InputArray points, cv::OutputArray normals) const override {
+		volume.fetchNormals(points, normals);
+	}
+
+	void reset() override {
+		frameCounter = 0;
+		pose = cv::Affine3f::Identity();
+		volume.reset();
+	}
+
+	const cv::Affine3f getPose() const override {
+		return pose;
+	}
+
+	bool update(cv::InputArray _depth) override {
+		cv::Mat depth;
+		_depth.getMat().convertTo(depth, CV_32F, 1.f / params.depthFactor);
+		if(params.truncateThreshold > 0){
+			cv::threshold(depth, depth, params.truncateThreshold, 0, cv::THRESH_TOZERO_INV);
+		}
+		cv::Mat smooth;
+		cv::bilateralFilter(depth, smooth, params.bilateral_kernel_size,
+			params.bilateral_sigma_depth, params.bilateral_sigma_spatial);
+		smooth.setTo(0, depth == 0);
+
+		std::vector<cv::Mat> points, normals;
+		makePyramid(smooth, points, normals);
+		if(frameCounter == 0){
+			volume.integrate(depth, pose, params.intr);
+		}
+		else{
+			// current camera -> previous camera
+			cv::Affine3f T = cv::Affine3f::Identity();
+			if(!icp(T, points, normals)) return false;
+			pose = pose * T;
+			const float rnorm = (float)cv::norm(T.rvec());
+			const float tnorm = (float)cv::norm(T.translation());
+			if((rnorm + tnorm) / 2 >= params.tsdf_min_camera_movement){
+				volume.integrate(depth, pose, params.intr);
+			}
+		}
+		volume.raycast(pose, params.intr, params.frameSize, modelPoints[0], modelNormals[0]);
+		for(int l=1; l<params.pyramidLevels; l++){
+			decimate(modelPoints[l-1], modelPoints[l]);
+			decimate(modelNormals[l-1], modelNormals[l]);
+		}
+		frameCounter++;
+		return true;
+	}
+
+private:
+	cv::kinfu::Params params;
+	TsdfBrickVolume<Traits> volume;
+	cv::Affine3f pose;
+	int frameCounter;
+	// ray-casted points and normals of the last frame in its camera coordinates, per pyramid level
+	cv::Mat modelPoints[8], modelNormals[8];
+
+	static void decimate(const cv::Mat& src, cv::Mat& dst){
+		dst.create(src.rows / 2, src.cols / 2, src.type());
+		for(int y=0; y<dst.rows; y++){
+			const cv::Vec3f* ps = src.ptr<cv::Vec3f>(2*y);
+			cv::Vec3f* pd = dst.ptr<cv::Vec3f>(y);
+			for(int x=0; x<dst.cols; x++) pd[x] = ps[2*x];
+		}
+	}
+
+	// intrinsics of the pyramid level by decimation
+	cv::Matx33f levelIntr(int level) const {
+		const float s = 1.f / (1 << level);
+		return cv::Matx33f(params.intr(0,0) * s, 0, params.intr(0,2) * s,
+			0, params.intr(1,1) * s, params.intr(1,2) * s, 0, 0, 1);
+	}
+
+	void makePyramid(const cv::Mat& depth, std::vector<cv::Mat>& points, std::vector<cv::Mat>& normals) const {
+		const float nan = std::numeric_limits<float>::quiet_NaN();
+		CV_Assert(params.pyramidLevels <= 8);
+		points.resize(params.pyramidLevels);
+		normals.resize(params.pyramidLevels);
+		cv::Mat d = depth;
+		for(int l=0; l<params.pyramidLevels; l++){
+			if(l > 0){
+				cv::Mat dd(d.rows / 2, d.cols / 2, CV_32FC1);
+				for(int y=0; y<dd.rows; y++){
+					for(int x=0; x<dd.cols; x++) dd.at<float>(y, x) = d.at<float>(2*y, 2*x);
+				}
+				d = dd;
+			}
+			const cv::Matx33f intr = levelIntr(l);
+			const float fxinv = 1.f / intr(0,0), fyinv = 1.f / intr(1,1), cx = intr(0,2), cy = intr(1,2);
+			cv::Mat& pts = points[l];
+			cv::Mat& nrm = normals[l];
+			pts.create(d.size(), CV_32FC3);
+			nrm.create(d.size(), CV_32FC3);
+			for(int y=0; y<d.rows; y++){
+				const float* pd = d.ptr<float>(y);
+				cv::Vec3f* pp = pts.ptr<cv::Vec3f>(y);
+				for(int x=0; x<d.cols; x++){
+					pp[x] = (pd[x] > 0) ? cv::Vec3f((x - cx) * fxinv * pd[x], (y - cy) * fyinv * pd[x], pd[x]) : cv::Vec3f::all(nan);
+				}
+			}
+			for(int y=0; y<d.rows; y++){
+				cv::Vec3f* pn = nrm.ptr<cv::Vec3f>(y);
+				for(int x=0; x<d.cols; x++){
+					pn[x] = cv::Vec3f::all(nan);
+					if(x + 1 >= d.cols || y + 1 >= d.rows) continue;
+					const cv::Vec3f p = pts.at<cv::Vec3f>(y, x);
+					const cv::Vec3f px = pts.at<cv::Vec3f>(y, x + 1);
+					const cv::Vec3f py = pts.at<cv::Vec3f>(y + 1, x);
+					if(cvIsNaN(p[0]) || cvIsNaN(px[0]) || cvIsNaN(py[0])) continue;
+					cv::Vec3f n = (px - p).cross(py - p);
+					const float len = (float)cv::norm(n);
+					if(len < FLT_EPSILON) continue;
+					n *= 1.f / len;
+					pn[x] = (n.dot(p) > 0) ? -n : n;	// facing the camera
+				}
+			}
+		}
+	}
+
+	// frame-to-model point-to-plane ICP, coarse to fine.
+	// T : current camera -> previous camera, whose ray-casted model is modelPoints/modelNormals
+	bool icp(cv::Affine3f& T, const std::vector<cv::Mat>& points, const std::vector<cv::Mat>& normals) const {
+		const float distThresh2 = params.icpDistThresh * params.icpDistThresh;
+		const float cosThresh = std::cos(params.icpAngleThresh);
+		for(int l=params.pyramidLevels-1; l>=0; l--){
+			const cv::Matx33f intr = levelIntr(l);
+			const float fx = intr(0,0), fy = intr(1,1), cx = intr(0,2), cy = intr(1,2);
+			const cv::Mat& pts = points[l];
+			const cv::Mat& nrm = normals[l];
+			const cv::Mat& mpts = modelPoints[l];
+			const cv::Mat& mnrm = modelNormals[l];
+			for(int it=0; it<params.icpIterations[l]; it++){
+				const cv::Matx33f R = T.rotation();
+				const cv::Vec3f t = T.translation();
+				// sum of J*J^T and J*r per stripe of rows
+				const int nStripes = std::max(1, std::min(pts.rows, cv::getNumThreads() * 4));
+				std::vector<cv::Matx66d> As(nStripes, cv::Matx66d::zeros());
+				std::vector<cv::Vec6d> bs(nStripes, cv::Vec6d::all(0));
+				std::vector<int> counts(nStripes, 0);
+				cv::parallel_for_(cv::Range(0, nStripes), [&](const cv::Range& r){
+					for(int s=r.start; s<r.end; s++){
+						cv::Matx66d& A = As[s];
+						cv::Vec6d& b = bs[s];
+						for(int y=pts.rows * s / nStripes; y<pts.rows * (s + 1) / nStripes; y++){
+							const cv::Vec3f* pp = pts.ptr<cv::Vec3f>(y);
+							const cv::Vec3f* pn = nrm.ptr<cv::Vec3f>(y);
+							for(int x=0; x<pts.cols; x++){
+								if(cvIsNaN(pn[x][0])) continue;
+								const cv::Vec3f p = R * pp[x] + t;
+								if(p[2] <= 0) continue;
+								const int u = cvRound(fx * p[0] / p[2] + cx), v = cvRound(fy * p[1] / p[2] + cy);
+								if(u < 0 || v < 0 || u >= mpts.cols || v >= mpts.rows) continue;
+								const cv::Vec3f q = mpts.at<cv::Vec3f>(v, u);
+								const cv::Vec3f nq = mnrm.at<cv::Vec3f>(v, u);
+								if(cvIsNaN(q[0]) || cvIsNaN(nq[0])) continue;
+								const cv::Vec3f diff = p - q;
+								if(diff.dot(diff) > distThresh2 || (R * pn[x]).dot(nq) < cosThresh) continue;
+								const cv::Vec3f c = p.cross(nq);
+								const cv::Vec6d J(c[0], c[1], c[2], nq[0], nq[1], nq[2]);
+								A += J * J.t();
+								b += J * (double)nq.dot(diff);
+								counts[s]++;
+							}
+						}
+					}
+				});
+				cv::Matx66d A = cv::Matx66d::zeros();
+				cv::Vec6d b = cv::Vec6d::all(0);
+				int count = 0;
+				for(int s=0; s<nStripes; s++){
+					A += As[s];
+					b += bs[s];
+					count += counts[s];
+				}
+				if(count < 6) return false;
+				cv::Mat x;
+				if(!cv::solve(cv::Mat(A), cv::Mat(-b), x, cv::DECOMP_CHOLESKY)) return false;
+				const cv::Vec6d dx(x.ptr<double>());
+				T = cv::Affine3f(cv::Vec3f((float)dx[0], (float)dx[1], (float)dx[2]),
+					cv::Vec3f((float)dx[3], (float)dx[4], (float)dx[5])) * T;
+			}
+		}
+		return true;
+	}
+
+	// same shading as OpenCV's kinfu
+	static void renderPointsNormals(const cv::Mat& points, const cv::Mat& normals, cv::OutputArray image, const cv::Vec3f& lightLoc){
+		image.create(points.size(), CV_8UC4);
+		cv::Mat img = image.getMat();
+		const float Ka = 0.3f, Kd = 0.5f, Ks = 0.2f;
+		const int sp = 20;
+		cv::parallel_for_(cv::Range(0, points.rows), [&](const cv::Range& r){
+			for(int y=r.start; y<r.end; y++){
+				const cv::Vec3f* pp = points.ptr<cv::Vec3f>(y);
+				const cv::Vec3f* pn = normals.ptr<cv::Vec3f>(y);
+				cv::Vec4b* pi = img.ptr<cv::Vec4b>(y);
+				for(int x=0; x<points.cols; x++){
+					const cv::Vec3f p = pp[x], n = pn[x];
+					if(cvIsNaN(p[0]) || cvIsNaN(n[0])){
+						pi[x] = cv::Vec4b(0, 0, 0, 0);
+						continue;
+					}
+					const cv::Vec3f l = cv::normalize(lightLoc - p);
+					const cv::Vec3f v = cv::normalize(-p);
+					const cv::Vec3f rf = cv::normalize(n * (2 * n.dot(l)) - l);
+					const float ix = Ka + Kd * std::max(0.f, n.dot(l)) + Ks * std::pow(std::max(0.f, rf.dot(v)), (float)sp);
+					const uchar c = cv::saturate_cast<uchar>(ix * 255);
+					pi[x] = cv::Vec4b(c, c, c, 0);
+				}
+			}
+		});
+	}
+};
+
+// volume_engine : 0:OpenCV, 1:native float (8 bytes/voxel), 2:native 16-bit (2 bytes/voxel)
+static inline cv::Ptr<cv::kinfu::KinFu> createKinFu(const cv::Ptr<cv::kinfu::Params>& params, int volume_engine)
+{
+	if(volume_engine == 1) return cv::makePtr<NativeKinFu<TsdfFloatTraits> >(*params);
+	if(volume_engine == 2) return cv::makePtr<NativeKinFu<TsdfPacked16Traits> >(*params);
+	return cv::kinfu::KinFu::create(params);
+}
+
@@ -4,6 +4,7 @@
 #include <opencv2/opencv.hpp>
 #include <opencv2/rgbd.hpp>
 #include "orbbec_utils.h"
+#include "kinfu_config.h"
 
 // ref: https://docs.opencv.org/4.x/d4/d94/tutorial_camera_calibration.html
 class OrbbecCameraMatrix
@@ -74,6 +75,17 @@ public:
 		cv::remap(src, dst, color_map1, color_map2, cfg_interpolation, cv::BORDER_CONSTANT, cv::Scalar());
 	}
 	
+	// override kinfu and colored kinfu params by a config file (e.g. saved by OrbbecKinfuTune)
+	bool loadKinfuParams(const std::string& filename){
+		if(!::loadKinfuParams(filename, *kinfu_params.get())) return false;
+		::loadKinfuParams(filename, *colored_kinfu_params.get());
+		printf("<kinfu params loaded from %s>\n", filename.c_str());
+		print_kinfu_params(*kinfu_params.get());
+		printf("<colored_kinfu params loaded from %s>\n", filename.c_str());
+		print_kinfu_params(*colored_kinfu_params.get());
+		return true;
+	}
+	
 	cv::Ptr<cv::kinfu::Params>& getKinfuParams(){
 		return kinfu_params;
 	}
@@ -0,0 +1,507 @@
+// MIT License : Copyright (c) 2024 Yukiyoshi Sasao
+#pragma once
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <limits>
+#include <opencv2/opencv.hpp>
+
+// Native TSDF volume with brick-blocked voxel storage.
+// The volume is divided into 8^3 voxel bricks, looked up by the Morton code of the brick coordinates.
+// Bricks are stored in a contiguous pool kept in Morton order: new ones are appended in Morton order,
+// and the pool is re-sorted when the appended part has grown by 1/8, so the copies are amortized.
+// A brick is allocated and integrated only if it is in the view frustum and the truncation band of a depth frame,
+// and ray-casting jumps over unallocated bricks.
+// The signed distance is measured along the camera ray as OpenCV's TSDF volume.
+// In a brick, TSDF and weight are separate arrays, and voxels are processed by x-runs of 8
+// written as fixed-length loops without branches for the compiler to vectorize.
+
+// TSDF and weight as float, 8 bytes per voxel
+struct TsdfFloatTraits {
+	typedef float TsdfType;
+	typedef float WeightType;
+	enum { MAX_WEIGHT = INT_MAX };
+	static inline float toFloat(TsdfType v){ return v; }
+	static inline TsdfType fromFloat(float v){ return v; }
+};
+// TSDF as int8 and weight as uint8, 2 bytes per voxel as OpenCV's TSDF volume
+struct TsdfPacked16Traits {
+	typedef int8_t TsdfType;
+	typedef uint8_t WeightType;
+	enum { MAX_WEIGHT = UCHAR_MAX };
+	static inline float toFloat(TsdfType v){ return v * (1.f / 127.f); }
+	static inline TsdfType fromFloat(float v){ return (TsdfType)(v * 127.f + (v >= 0 ? 0.5f : -0.5f)); }
+};
+
+static inline uint32_t mortonSpreadBits(uint32_t v)
+{
+	v &= 0x3ff;	// 10 bits -> 30 bits
+	v = (v | (v << 16)) & 0x030000FF;
+	v = (v | (v <<  8)) & 0x0300F00F;
+	v = (v | (v <<  4)) & 0x030C30C3;
+	v = (v | (v <<  2)) & 0x09249249;
+	return v;
+}
+static inline uint32_t mortonCode(int x, int y, int z)
+{
+	return mortonSpreadBits(x) | (mortonSpreadBits(y) << 1) | (mortonSpreadBits(z) << 2);
+}
+
+template<class Traits>
+class TsdfBrickVolume
+{
+public:
+	typedef typename Traits::TsdfType TsdfType;
+	typedef typename Traits::WeightType WeightType;
+	enum { BRICK_SHIFT = 3, BRICK = 1 << BRICK_SHIFT, BRICK_VOXELS = BRICK * BRICK * BRICK };
+	struct Brick {
+		TsdfType tsdf[BRICK_VOXELS];
+		WeightType weight[BRICK_VOXELS];
+	};
+
+	// volumeDims is rounded up to a multiple of the brick size, maxWeight is clamped to the weight type
+	TsdfBrickVolume(float _voxelSize, const cv::Vec3i& _volumeDims, const cv::Affine3f& _pose,
+		float _truncDist, int _maxWeight, float _raycastStepFactor){
+		voxelSize = _voxelSize;
+		voxelSizeInv = 1.f / voxelSize;
+		pose = _pose;
+		poseInv = pose.inv();
+		truncDist = std::max(_truncDist, 2.1f * voxelSize);
+		maxWeight = (float)std::min(_maxWeight, (int)Traits::MAX_WEIGHT);
+		raycastStepFactor = _raycastStepFactor;
+		int maxBrickDim = 1;
+		for(int k=0; k<3; k++){
+			brickDims[k] = (_volumeDims[k] + BRICK - 1) / BRICK;
+			volumeDims[k] = brickDims[k] * BRICK;
+			maxBrickDim = std::max(maxBrickDim, brickDims[k]);
+		}
+		CV_Assert(maxBrickDim <= 1024);
+		int p2 = 1;
+		while(p2 < maxBrickDim) p2 <<= 1;
+		table.resize((size_t)p2 * p2 * p2);
+		reset();
+	}
+
+	void reset(){
+		std::fill(table.begin(), table.end(), -1);
+		bricks.clear();
+		brickCoords.clear();
+		brickCodes.clear();
+		sortedBricks = 0;
+	}
+
+	// including the spare capacity of the pool
+	size_t getMemoryBytes() const {
+		return bricks.capacity() * sizeof(Brick) + brickCoords.capacity() * sizeof(cv::Vec3i)
+			+ brickCodes.capacity() * sizeof(uint32_t) + table.size() * sizeof(int);
+	}
+	int getBrickCount() const {
+		return (int)bricks.size();
+	}
+
+	// depth : CV_32FC1 in meters, 0 is invalid
+	void integrate(const cv::Mat& depth, const cv::Affine3f& cameraPose, const cv::Matx33f& intr){
+		CV_Assert(depth.type() == CV_32FC1 && depth.isContinuous());
+		const cv::Affine3f vol2cam = cameraPose.inv() * pose;
+		updatePixNorms(intr, depth.size());
+
+		// depth range of tiles, to test the truncation band of bricks
+		const cv::Size tiles((depth.cols + TILE - 1) / TILE, (depth.rows + TILE - 1) / TILE);
+		cv::Mat tileMin(tiles, CV_32FC1, cv::Scalar(FLT_MAX)), tileMax(tiles, CV_32FC1, cv::Scalar(0));
+		for(int y=0; y<depth.rows; y++){
+			const float* pdata = depth.ptr<float>(y);
+			float* pmin = tileMin.ptr<float>(y / TILE);
+			float* pmax = tileMax.ptr<float>(y / TILE);
+			for(int x=0; x<depth.cols; x++){
+				const float d = pdata[x];
+				if(d <= 0) continue;
+				pmin[x / TILE] = std::min(pmin[x / TILE], d);
+				pmax[x / TILE] = std::max(pmax[x / TILE], d);
+			}
+		}
+
+		// bricks in the view frustum and the truncation band
+		const int nBricks = brickDims[0] * brickDims[1] * brickDims[2];
+		std::vector<uchar> inBand(nBricks, 0);
+		cv::parallel_for_(cv::Range(0, brickDims[1] * brickDims[2]), [&](const cv::Range& r){
+			for(int yz=r.start; yz<r.end; yz++){
+				const int by = yz % brickDims[1], bz = yz / brickDims[1];
+				for(int bx=0; bx<brickDims[0]; bx++){
+					inBand[bx + brickDims[0] * yz] = brickInBand(cv::Vec3i(bx, by, bz), vol2cam, intr, depth.size(), tileMin, tileMax);
+				}
+			}
+		});
+
+		// allocate new ones at the end of the pool in Morton order
+		std::vector<std::pair<uint32_t, int> > codes;
+		for(int i=0; i<nBricks; i++){
+			if(!inBand[i]) continue;
+			const int bx = i % brickDims[0], by = (i / brickDims[0]) % brickDims[1], bz = i / (brickDims[0] * brickDims[1]);
+			codes.push_back(std::make_pair(mortonCode(bx, by, bz), i));
+		}
+		std::sort(codes.begin(), codes.end());
+		for(const std::pair<uint32_t, int>& c : codes){
+			if(table[c.first] >= 0) continue;
+			const int i = c.second;
+			table[c.first] = (int)bricks.size();
+			bricks.resize(bricks.size() + 1);
+			Brick& brick = bricks.back();
+			std::fill(brick.tsdf, brick.tsdf + BRICK_VOXELS, Traits::fromFloat(1.f));
+			std::fill(brick.weight, brick.weight + BRICK_VOXELS, (WeightType)0);
+			brickCoords.push_back(cv::Vec3i(i % brickDims[0], (i / brickDims[0]) % brickDims[1], i / (brickDims[0] * brickDims[1])));
+			brickCodes.push_back(c.first);
+		}
+		if(bricks.size() - sortedBricks > sortedBricks / 8) sortBricks();
+
+		// integrate in the pool order
+		std::vector<int> targets;
+		for(const std::pair<uint32_t, int>& c : codes) targets.push_back(table[c.first]);
+		std::sort(targets.begin(), targets.end());
+		cv::parallel_for_(cv::Range(0, (int)targets.size()), [&](const cv::Range& r){
+			for(int i=r.start; i<r.end; i++){
+				const int bi = targets[i];
+				integrateBrick(bricks[bi], brickCoords[bi], vol2cam, intr, depth);
+			}
+		});
+	}
+
+	// points, normals : CV_32FC3 in camera coordinates, NaN if no surface
+	void raycast(const cv::Affine3f& cameraPose, const cv::Matx33f& intr, const cv::Size& frameSize,
+		cv::Mat& points, cv::Mat& normals) const {
+		points.create(frameSize, CV_32FC3);
+		normals.create(frameSize, CV_32FC3);
+		const cv::Affine3f cam2vol = poseInv * cameraPose;
+		const cv::Matx33f volRot = cam2vol.rotation();
+		const cv::Matx33f camRot = volRot.t();
+		const cv::Vec3f org = cam2vol.translation() * voxelSizeInv;
+		const float stepDist = truncDist * raycastStepFactor;
+		const float fx = intr(0,0), fy = intr(1,1), cx = intr(0,2), cy = intr(1,2);
+		const float nan = std::numeric_limits<float>::quiet_NaN();
+
+		cv::parallel_for_(cv::Range(0, frameSize.height), [&](const cv::Range& r){
+			for(int y=r.start; y<r.end; y++){
+				cv::Vec3f* ppts = points.ptr<cv::Vec3f>(y);
+				cv::Vec3f* pnrm = normals.ptr<cv::Vec3f>(y);
+				for(int x=0; x<frameSize.width; x++){
+					// t is the depth in meters, the ray moves dir voxels per meter of depth
+					const cv::Vec3f rayCam((x - cx) / fx, (y - cy) / fy, 1.f);
+					const cv::Vec3f dir = (volRot * rayCam) * voxelSizeInv;
+					const float rayNormInv = 1.f / (float)cv::norm(rayCam);
+					const float tstep = stepDist * rayNormInv;
+					ppts[x] = pnrm[x] = cv::Vec3f::all(nan);
+					float tmin, tmax;
+					if(!intersectBox(org, dir, cv::Vec3f::all(0), cv::Vec3f(volumeDims), tmin, tmax)) continue;
+					float t = std::max(tmin, 0.f) + 1e-4f;
+					float prevF = 0, prevT = 0;
+					bool b_prev = false;
+					while(t < tmax){
+						const cv::Vec3f p = org + dir * t;
+						const cv::Vec3i b((int)p[0] >> BRICK_SHIFT, (int)p[1] >> BRICK_SHIFT, (int)p[2] >> BRICK_SHIFT);
+						if(!insideBricks(b)) break;
+						if(table[mortonCode(b[0], b[1], b[2])] < 0){
+							// skip an unallocated brick
+							float tb0, tb1;
+							intersectBox(org, dir, cv::Vec3f(b * BRICK), cv::Vec3f((b + cv::Vec3i::all(1)) * BRICK), tb0, tb1);
+							t = std::max(tb1, t + tstep * 0.01f) + 1e-4f;
+							b_prev = false;
+							continue;
+						}
+						float f;
+						if(!interpolate(p, f)){
+							b_prev = false;
+							t += tstep;
+							continue;
+						}
+						if(b_prev && prevF > 0 && f <= 0){
+							// zero crossing from the front
+							const float tz = prevT + (t - prevT) * prevF / (prevF - f);
+							cv::Vec3f g;
+							if(gradient(org + dir * tz, g)){
+								ppts[x] = rayCam * tz;
+								pnrm[x] = camRot * g;
+							}
+							break;
+						}
+						if(b_prev && prevF < 0 && f > 0) break;	// back face
+						b_prev = true;
+						prevF = f;
+						prevT = t;
+						t += std::max(tstep, f * truncDist * rayNormInv);
+					}
+				}
+			}
+		});
+	}
+
+	// surface points and normals in the world coordinates, CV_32FC4 Nx1
+	void fetchPointsNormals(cv::OutputArray _points, cv::OutputArray _normals) const {
+		std::vector<std::vector<cv::Vec4f> > pts(bricks.size()), nrms(bricks.size());
+		const bool b_normals = _normals.needed();
+		cv::parallel_for_(cv::Range(0, (int)bricks.size()), [&](const cv::Range& r){
+			for(int bi=r.start; bi<r.end; bi++){
+				const Brick& brick = bricks[bi];
+				const cv::Vec3i b0 = brickCoords[bi] * BRICK;
+				for(int i=0; i<BRICK_VOXELS; i++){
+					if(brick.weight[i] == 0) continue;
+					const cv::Vec3i v = b0 + cv::Vec3i(i & (BRICK-1), (i >> BRICK_SHIFT) & (BRICK-1), i >> (2*BRICK_SHIFT));
+					const float f0 = Traits::toFloat(brick.tsdf[i]);
+					for(int k=0; k<3; k++){
+						cv::Vec3i vn = v;
+						vn[k]++;
+						float f1;
+						if(!fetch(vn, f1) || (f0 > 0) == (f1 > 0)) continue;
+						cv::Vec3f p = cv::Vec3f(v) + cv::Vec3f::all(0.5f);
+						p[k] += f0 / (f0 - f1);
+						cv::Vec3f g;
+						if(!gradient(p, g)) continue;
+						const cv::Vec3f pw = pose * (p * voxelSize);
+						pts[bi].push_back(cv::Vec4f(pw[0], pw[1], pw[2], 0));
+						if(b_normals){
+							const cv::Vec3f nw = pose.rotation() * g;
+							nrms[bi].push_back(cv::Vec4f(nw[0], nw[1], nw[2], 0));
+						}
+					}
+				}
+			}
+		});
+		std::vector<cv::Vec4f> allPts, allNrms;
+		for(size_t i=0; i<pts.size(); i++){
+			allPts.insert(allPts.end(), pts[i].begin(), pts[i].end());
+			if(b_normals) allNrms.insert(allNrms.end(), nrms[i].begin(), nrms[i].end());
+		}
+		cv::Mat(allPts, true).copyTo(_points);
+		if(b_normals) cv::Mat(allNrms, true).copyTo(_normals);
+	}
+
+	// normals at points in the world coordinates
+	void fetchNormals(cv::InputArray _points, cv::OutputArray _normals) const {
+		cv::Mat points = _points.getMat();
+		CV_Assert(points.depth() == CV_32F && (points.channels() == 3 || points.channels() == 4));
+		_normals.create(points.size(), points.type());
+		cv::Mat normals = _normals.getMat();
+		const cv::Matx33f rot = pose.rotation();
+		const float nan = std::numeric_limits<float>::quiet_NaN();
+		for(int y=0; y<points.rows; y++){
+			const float* pp = points.ptr<float>(y);
+			float* pn = normals.ptr<float>(y);
+			for(int x=0; x<points.cols; x++, pp += points.channels(), pn += points.channels()){
+				const cv::Vec3f p = (poseInv * cv::Vec3f(pp[0], pp[1], pp[2])) * voxelSizeInv;
+				cv::Vec3f g;
+				const cv::Vec3f n = gradient(p, g) ? rot * g : cv::Vec3f::all(nan);
+				for(int k=0; k<points.channels(); k++) pn[k] = (k < 3) ? n[k] : 0.f;
+			}
+		}
+	}
+
+private:
+	enum { TILE = 8 };
+
+	float voxelSize, voxelSizeInv;
+	cv::Affine3f pose, poseInv;	// volume to world
+	float truncDist;
+	float maxWeight;
+	float raycastStepFactor;
+	cv::Vec3i brickDims, volumeDims;
+	std::vector<int> table;	// Morton code -> index of bricks, -1 if not allocated
+	std::vector<Brick> bricks;	// pool
+	std::vector<cv::Vec3i> brickCoords;
+	std::vector<uint32_t> brickCodes;
+	size_t sortedBricks;	// bricks[0, sortedBricks) are in Morton order
+	cv::Mat pixNorms;	// length of the camera ray per meter of depth at each pixel
+	cv::Matx33f pixNormsIntr;
+
+	void updatePixNorms(const cv::Matx33f& intr, const cv::Size& size){
+		if(pixNorms.size() == size && pixNormsIntr == intr) return;
+		const float fx = intr(0,0), fy = intr(1,1), cx = intr(0,2), cy = intr(1,2);
+		pixNorms.create(size, CV_32FC1);
+		for(int y=0; y<size.height; y++){
+			float* pn = pixNorms.ptr<float>(y);
+			const float ry = (y - cy) / fy;
+			for(int x=0; x<size.width; x++){
+				const float rx = (x - cx) / fx;
+				pn[x] = std::sqrt(rx * rx + ry * ry + 1.f);
+			}
+		}
+		pixNormsIntr = intr;
+	}
+
+	// sorts the pool by Morton code and updates the table
+	void sortBricks(){
+		std::vector<int> order(bricks.size());
+		for(size_t i=0; i<order.size(); i++) order[i] = (int)i;
+		std::sort(order.begin(), order.end(), [&](int a, int b){ return brickCodes[a] < brickCodes[b]; });
+		std::vector<Brick> sorted;
+		std::vector<cv::Vec3i> sortedCoords;
+		std::vector<uint32_t> sortedCodes;
+		sorted.reserve(bricks.capacity());
+		sortedCoords.reserve(brickCoords.capacity());
+		sortedCodes.reserve(brickCodes.capacity());
+		for(int i : order){
+			table[brickCodes[i]] = (int)sorted.size();
+			sorted.push_back(bricks[i]);
+			sortedCoords.push_back(brickCoords[i]);
+			sortedCodes.push_back(brickCodes[i]);
+		}
+		bricks.swap(sorted);
+		brickCoords.swap(sortedCoords);
+		brickCodes.swap(sortedCodes);
+		sortedBricks = bricks.size();
+	}
+
+	inline bool insideBricks(const cv::Vec3i& b) const {
+		return (unsigned)b[0] < (unsigned)brickDims[0] && (unsigned)b[1] < (unsigned)brickDims[1] && (unsigned)b[2] < (unsigned)brickDims[2];
+	}
+
+	inline bool fetch(const cv::Vec3i& v, float& f) const {
+		const cv::Vec3i b(v[0] >> BRICK_SHIFT, v[1] >> BRICK_SHIFT, v[2] >> BRICK_SHIFT);
+		if(v[0] < 0 || v[1] < 0 || v[2] < 0 || !insideBricks(b)) return false;
+		const int bi = table[mortonCode(b[0], b[1], b[2])];
+		if(bi < 0) return false;
+		const int i = (v[0] & (BRICK-1)) + ((v[1] & (BRICK-1)) << BRICK_SHIFT) + ((v[2] & (BRICK-1)) << (2*BRICK_SHIFT));
+		if(bricks[bi].weight[i] == 0) return false;
+		f = Traits::toFloat(bricks[bi].tsdf[i]);
+		return true;
+	}
+
+	// trilinear TSDF at p [voxel], voxel centers are at +0.5
+	inline bool interpolate(const cv::Vec3f& p, float& f) const {
+		const float px = p[0] - 0.5f, py = p[1] - 0.5f, pz = p[2] - 0.5f;
+		const int x0 = cvFloor(px), y0 = cvFloor(py), z0 = cvFloor(pz);
+		const float tx = px - x0, ty = py - y0, tz = pz - z0;
+		float c[8];
+		for(int i=0; i<8; i++){
+			if(!fetch(cv::Vec3i(x0 + (i & 1), y0 + ((i >> 1) & 1), z0 + (i >> 2)), c[i])) return false;
+		}
+		const float c00 = c[0] + (c[1] - c[0]) * tx, c10 = c[2] + (c[3] - c[2]) * tx;
+		const float c01 = c[4] + (c[5] - c[4]) * tx, c11 = c[6] + (c[7] - c[6]) * tx;
+		const float c0 = c00 + (c10 - c00) * ty, c1 = c01 + (c11 - c01) * ty;
+		f = c0 + (c1 - c0) * tz;
+		return true;
+	}
+
+	// normalized TSDF gradient at p [voxel] in the volume coordinates
+	inline bool gradient(const cv::Vec3f& p, cv::Vec3f& g) const {
+		for(int k=0; k<3; k++){
+			cv::Vec3f p0 = p, p1 = p;
+			p0[k] -= 1.f;
+			p1[k] += 1.f;
+			float f0, f1;
+			if(!interpolate(p0, f0) || !interpolate(p1, f1)) return false;
+			g[k] = f1 - f0;
+		}
+		const float n = (float)cv::norm(g);
+		if(n < FLT_EPSILON) return false;
+		g *= 1.f / n;
+		return true;
+	}
+
+	static inline bool intersectBox(const cv::Vec3f& org, const cv::Vec3f& dir,
+		const cv::Vec3f& bmin, const cv::Vec3f& bmax, float& tmin, float& tmax){
+		tmin = -FLT_MAX;
+		tmax = FLT_MAX;
+		for(int k=0; k<3; k++){
+			if(std::abs(dir[k]) < 1e-9f){
+				if(org[k] < bmin[k] || org[k] > bmax[k]) return false;
+				continue;
+			}
+			float t0 = (bmin[k] - org[k]) / dir[k], t1 = (bmax[k] - org[k]) / dir[k];
+			if(t0 > t1) std::swap(t0, t1);
+			tmin = std::max(tmin, t0);
+			tmax = std::min(tmax, t1);
+		}
+		return tmin <= tmax && tmax > 0;
+	}
+
+	bool brickInBand(const cv::Vec3i& b, const cv::Affine3f& vol2cam, const cv::Matx33f& intr,
+		const cv::Size& size, const cv::Mat& tileMin, const cv::Mat& tileMax) const {
+		const float fx = intr(0,0), fy = intr(1,1), cx = intr(0,2), cy = intr(1,2);
+		float zmin = FLT_MAX, zmax = -FLT_MAX;
+		float umin = FLT_MAX, umax = -FLT_MAX, vmin = FLT_MAX, vmax = -FLT_MAX;
+		bool b_behind = false;
+		for(int i=0; i<8; i++){
+			const cv::Vec3f corner = cv::Vec3f(b + cv::Vec3i(i & 1, (i >> 1) & 1, i >> 2)) * (BRICK * voxelSize);
+			const cv::Vec3f pc = vol2cam * corner;
+			zmin = std::min(zmin, pc[2]);
+			zmax = std::max(zmax, pc[2]);
+			if(pc[2] <= 0){
+				b_behind = true;
+				continue;
+			}
+			const float u = fx * pc[0] / pc[2] + cx, v = fy * pc[1] / pc[2] + cy;
+			umin = std::min(umin, u);
+			umax = std::max(umax, u);
+			vmin = std::min(vmin, v);
+			vmax = std::max(vmax, v);
+		}
+		if(zmax <= 0) return false;
+		if(b_behind){
+			// crossing the camera plane, test the whole image
+			umin = vmin = 0;
+			umax = (float)size.width;
+			vmax = (float)size.height;
+		}
+		const int u0 = std::max(0, (int)std::floor(umin)), u1 = std::min(size.width - 1, (int)std::ceil(umax));
+		const int v0 = std::max(0, (int)std::floor(vmin)), v1 = std::min(size.height - 1, (int)std::ceil(vmax));
+		if(u0 > u1 || v0 > v1) return false;
+		float dmin = FLT_MAX, dmax = 0;
+		for(int ty=v0 / TILE; ty<=v1 / TILE; ty++){
+			const float* pmin = tileMin.ptr<float>(ty);
+			const float* pmax = tileMax.ptr<float>(ty);
+			for(int tx=u0 / TILE; tx<=u1 / TILE; tx++){
+				dmin = std::min(dmin, pmin[tx]);
+				dmax = std::max(dmax, pmax[tx]);
+			}
+		}
+		if(dmax <= 0) return false;
+		return zmax >= dmin - truncDist && zmin <= dmax + truncDist;
+	}
+
+	void integrateBrick(Brick& brick, const cv::Vec3i& b, const cv::Affine3f& vol2cam,
+		const cv::Matx33f& intr, const cv::Mat& depth) const {
+		const float fx = intr(0,0), fy = intr(1,1), cx = intr(0,2), cy = intr(1,2);
+		const float cols = (float)depth.cols, rows = (float)depth.rows;
+		const float* pdepth = depth.ptr<float>();
+		const float* pnorm = pixNorms.ptr<float>();
+		// locals, as stores into int8 TSDF may alias the members
+		const float truncD = truncDist, truncDistInv = 1.f / truncDist, maxW = maxWeight;
+		// camera coordinates of voxel centers = org + x*dx + y*dy + z*dz
+		const cv::Matx33f R = vol2cam.rotation();
+		const cv::Vec3f dx = cv::Vec3f(R(0,0), R(1,0), R(2,0)) * voxelSize;
+		const cv::Vec3f dy = cv::Vec3f(R(0,1), R(1,1), R(2,1)) * voxelSize;
+		const cv::Vec3f dz = cv::Vec3f(R(0,2), R(1,2), R(2,2)) * voxelSize;
+		const cv::Vec3f org = vol2cam * ((cv::Vec3f(b * BRICK) + cv::Vec3f::all(0.5f)) * voxelSize);
+
+		for(int z=0; z<BRICK; z++){
+			for(int y=0; y<BRICK; y++){
+				const cv::Vec3f row = org + dy * (float)y + dz * (float)z;
+				TsdfType* ptsdf = brick.tsdf + (y << BRICK_SHIFT) + (z << (2*BRICK_SHIFT));
+				WeightType* pweight = brick.weight + (y << BRICK_SHIFT) + (z << (2*BRICK_SHIFT));
+				float pz[BRICK], u[BRICK], v[BRICK], d[BRICK], n[BRICK];
+				for(int x=0; x<BRICK; x++){
+					pz[x] = row[2] + dx[2] * x;
+					const float zinv = 1.f / pz[x];
+					u[x] = fx * (row[0] + dx[0] * x) * zinv + cx + 0.5f;
+					v[x] = fy * (row[1] + dx[1] * x) * zinv + cy + 0.5f;
+				}
+				// load from a clamped pixel and select, no conditional load
+				for(int x=0; x<BRICK; x++){
+					const bool b_in = (pz[x] > 0) & (u[x] >= 0) & (v[x] >= 0) & (u[x] < cols) & (v[x] < rows);
+					const int i = (int)std::min(rows - 1.f, std::max(0.f, v[x])) * depth.cols + (int)std::min(cols - 1.f, std::max(0.f, u[x]));
+					const float di = pdepth[i];
+					d[x] = b_in ? di : 0.f;
+					n[x] = pnorm[i];
+				}
+				// blend by a 0/1 update factor, the TSDF of a skipped voxel stays as is
+				for(int x=0; x<BRICK; x++){
+					const float sdf = (d[x] - pz[x]) * n[x];
+					const float tsdf = std::max(-1.f, std::min(1.f, sdf * truncDistInv));
+					const float upd = ((d[x] > 0) & (sdf >= -truncD)) ? 1.f : 0.f;
+					const float w = (float)pweight[x];
+					const float f = Traits::toFloat(ptsdf[x]);
+					ptsdf[x] = Traits::fromFloat(f + (tsdf - f) * upd / (w + 1.f));
+					pweight[x] = (WeightType)std::min(w + upd, maxW);
+				}
+			}
+		}
+	}
+};
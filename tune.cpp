@@ -0,0 +1,427 @@
+// MIT License : Copyright (c) 2024 Yukiyoshi Sasao
+// Offline kinfu parameter sweep.
+// Replays a recorded (OrbbecKinfu -rec) or synthetic depth sequence with each parameter configuration
+// in parallel processes, and saves the pareto-optimal configurations as kinfu params files (OrbbecKinfu -kp).
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#ifndef _WIN32
+#include <cerrno>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "kinfu_config.h"
+#include "kinfu_sequence.h"
+#include "native_kinfu.h"
+
+enum {
+	TP_VOXEL_SIZE,
+	TP_VOLUME_DIMS,
+	TP_ICP_ITERATIONS,
+	TP_PYRAMID_LEVELS,
+	TP_TSDF_TRUNC_DIST,
+	TP_RAYCAST_STEP_FACTOR,
+	TP_BILATERAL_SIGMA_DEPTH,
+	TP_BILATERAL_SIGMA_SPATIAL,
+	TP_BILATERAL_KERNEL_SIZE,
+	TP_NUM
+};
+static const char* TuneParamStr[] = {
+	"voxelSize",
+	"volumeDims",
+	"icpIterations",
+	"pyramidLevels",
+	"tsdf_trunc_dist",
+	"raycast_step_factor",
+	"bilateral_sigma_depth",
+	"bilateral_sigma_spatial",
+	"bilateral_kernel_size",
+};
+static const bool TuneParamInt[] = {
+	false, true, true, true, false, false, false, false, true,
+};
+
+struct TUNE_RESULT_T {
+	int idx;
+	bool b_valid;
+	int frames;
+	double fps;			// kinfu update only
+	int icp_fail;
+	double drift;		// RMS of the translation error [m], <0 : not available
+	double drift_final;	// translation error of the last frame [m], <0 : not available
+};
+
+// config : a value for each TP_*, NAN if it is not swept
+static cv::Ptr<cv::kinfu::Params> makeTuneParams(const cv::kinfu::Params& base, const std::vector<double>& cfg)
+{
+	cv::Ptr<cv::kinfu::Params> p = cv::makePtr<cv::kinfu::Params>(base);
+	auto swept = [&](int i){ return !std::isnan(cfg[i]); };
+	for(int i=0; i<TP_NUM; i++){
+		if(!swept(i)) continue;
+		const double v = cfg[i];
+		switch(i){
+		case TP_VOXEL_SIZE: p->voxelSize = (float)v; break;
+		case TP_VOLUME_DIMS: p->volumeDims = cv::Vec3i::all((int)v); break;
+		case TP_PYRAMID_LEVELS: p->pyramidLevels = std::max(1, (int)v); break;
+		case TP_TSDF_TRUNC_DIST: p->tsdf_trunc_dist = (float)v; break;
+		case TP_RAYCAST_STEP_FACTOR: p->raycast_step_factor = (float)v; break;
+		case TP_BILATERAL_SIGMA_DEPTH: p->bilateral_sigma_depth = (float)v; break;
+		case TP_BILATERAL_SIGMA_SPATIAL: p->bilateral_sigma_spatial = (float)v; break;
+		case TP_BILATERAL_KERNEL_SIZE: p->bilateral_kernel_size = (int)v; break;
+		default: break;	// TP_ICP_ITERATIONS is expanded below
+		}
+	}
+	// keep the volume extent and the truncation distance in voxels of base unless they are swept
+	if(swept(TP_VOLUME_DIMS) && !swept(TP_VOXEL_SIZE)){
+		p->voxelSize = base.voxelSize * base.volumeDims[0] / p->volumeDims[0];
+	}
+	if(!swept(TP_TSDF_TRUNC_DIST)){
+		p->tsdf_trunc_dist = base.tsdf_trunc_dist * p->voxelSize / base.voxelSize;
+	}
+	if(swept(TP_VOLUME_DIMS) || swept(TP_VOXEL_SIZE)){
+		centerKinfuVolume(*p);
+	}
+	// icpIterations needs an entry per pyramid level (finest first).
+	// A swept value is the finest level, coarser levels are halved.
+	std::vector<int> its(p->pyramidLevels);
+	for(int l=0; l<p->pyramidLevels; l++){
+		if(swept(TP_ICP_ITERATIONS)) its[l] = std::max(1, (int)cfg[TP_ICP_ITERATIONS] >> l);
+		else if(l < (int)base.icpIterations.size()) its[l] = base.icpIterations[l];
+		else its[l] = std::max(1, its[l-1] / 2);
+	}
+	p->icpIterations = its;
+	return p;
+}
+
+static TUNE_RESULT_T runTuneConfig(int idx, const cv::Ptr<cv::kinfu::Params>& params, int volume_engine,
+	const std::vector<cv::Mat>& depths, const std::vector<cv::Affine3f>& poses, bool b_loop)
+{
+	TUNE_RESULT_T r = {idx, false, 0, 0, 0, -1, -1};
+	try {
+		cv::Ptr<cv::kinfu::KinFu> kf = createKinFu(params, volume_engine);
+		const cv::Affine3f gt0inv = poses.empty() ? cv::Affine3f::Identity() : poses[0].inv();
+		cv::TickMeter tm;
+		double sq = 0;
+		for(size_t i=0; i<depths.size(); i++){
+			tm.start();
+			bool b_ok = kf->update(depths[i]);
+			tm.stop();
+			if(!b_ok) r.icp_fail++;
+			if(!poses.empty()){
+				cv::Vec3f e = kf->getPose().translation() - (gt0inv * poses[i]).translation();
+				sq += e.dot(e);
+				r.drift_final = cv::norm(e);
+			}
+		}
+		r.frames = (int)depths.size();
+		r.fps = r.frames / tm.getTimeSec();
+		if(!poses.empty()){
+			r.drift = std::sqrt(sq / r.frames);
+		}
+		else if(b_loop){
+			r.drift = r.drift_final = cv::norm(kf->getPose().translation());
+		}
+		r.b_valid = true;
+	}
+	catch(cv::Exception& e){
+		fprintf(stderr, "config %d : %s\n", idx, e.what());
+	}
+	return r;
+}
+
+static void printTuneResult(const TUNE_RESULT_T& r, const std::vector<double>& cfg)
+{
+	printf("%4d %s %8.2f %5d %9.4f %9.4f ", r.idx, r.b_valid ? "  " : "NG",
+		r.fps, r.icp_fail, r.drift, r.drift_final);
+	for(int i=0; i<TP_NUM; i++){
+		if(!std::isnan(cfg[i])) printf(" %s=%g", TuneParamStr[i], cfg[i]);
+	}
+	printf("\n");
+}
+
+// a dominates b : not worse in fps, icp failures and drift, and better in one of them
+static bool dominates(const TUNE_RESULT_T& a, const TUNE_RESULT_T& b, bool b_drift)
+{
+	if(a.fps < b.fps || a.icp_fail > b.icp_fail) return false;
+	if(b_drift && a.drift > b.drift) return false;
+	return a.fps > b.fps || a.icp_fail < b.icp_fail || (b_drift && a.drift < b.drift);
+}
+
+void usage(int argc, char *argv[])
+{
+	printf("usage: %s [options]\n", argv[0]);
+	printf(" -seq [dir]           replay a sequence recorded by OrbbecKinfu -rec\n");
+	printf(" -save [dir]          save the sequence (with ground truth poses) to an existing dir for -seq\n");
+	printf(" -n [nframes(100)]    frames of the synthetic sequence if -seq is not given\n");
+	printf(" -noise [noise(0.0015)]  synthetic depth noise sigma = noise * depth^2 [m]\n");
+	printf(" -loop                the sequence ends at its start pose (drift without ground truth)\n");
+	printf(" -kc                  coarse base params\n");
+	printf(" -kp [file]           load base kinfu params file\n");
+	printf(" -kv [kinfu_volume(0)]  TSDF volume, 0:OpenCV, 1:native float (8B/voxel), 2:native 16bit (2B/voxel)\n");
+	printf(" -p [name=v1,v2,..]   values to sweep, repeatable. names:\n");
+	printf("                      ");
+	for(int i=0; i<TP_NUM; i++) printf(" %s", TuneParamStr[i]);
+	printf("\n");
+	printf(" -rand [N(0)]         random search of N configs within [min,max] of -p values, 0:grid search\n");
+	printf(" -seed [seed(0)]      random seed\n");
+	printf(" -j [jobs]            parallel processes (default: cores / threads)\n");
+	printf(" -t [threads(1)]      OpenCV threads per process\n");
+	printf(" -cloff               set openCL off\n");
+	printf(" -o [out_dir(.)]      output directory of pareto-optimal kinfu params files\n");
+	printf(" \n");
+	printf("Without -p, volumeDims=256,512 icpIterations=5,10 pyramidLevels=2,3 raycast_step_factor=0.25,0.5 are swept.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	std::string seq_dir, save_dir, kp_file, out_dir = ".";
+	int nframes = 100;
+	float noise = 0.0015f;
+	bool b_loop = false;
+	bool b_coarse = false;
+	int volume_engine = 0;
+	int n_rand = 0;
+	int seed = 0;
+	int n_threads = 1;
+	int n_jobs = 0;
+	bool b_opencl_off = false;
+	std::vector<std::vector<double>> values(TP_NUM);
+	for(int i=1; i<argc; i++){
+		if(0==strcmp(argv[i], "--help")){
+			usage(argc, argv);
+			exit(0);
+		}
+		else if(0==strcmp(argv[i], "-seq")){
+			seq_dir = argv[++i];
+		}
+		else if(0==strcmp(argv[i], "-save")){
+			save_dir = argv[++i];
+		}
+		else if(0==strcmp(argv[i], "-n")){
+			nframes = atoi(argv[++i]);
+		}
+		else if(0==strcmp(argv[i], "-noise")){
+			noise = atof(argv[++i]);
+		}
+		else if(0==strcmp(argv[i], "-loop")){
+			b_loop = true;
+		}
+		else if(0==strcmp(argv[i], "-kc")){
+			b_coarse = true;
+		}
+		else if(0==strcmp(argv[i], "-kv")){
+			volume_engine = atoi(argv[++i]);
+		}
+		else if(0==strcmp(argv[i], "-kp")){
+			kp_file = argv[++i];
+		}
+		else if(0==strcmp(argv[i], "-p")){
+			std::string spec = argv[++i];
+			size_t eq = spec.find('=');
+			int k = 0;
+			for(; k<TP_NUM; k++){
+				if(spec.substr(0, eq) == TuneParamStr[k]) break;
+			}
+			if(eq == std::string::npos || k == TP_NUM){
+				printf("unknown param %s\n", spec.c_str());
+				exit(-1);
+			}
+			std::stringstream ss(spec.substr(eq + 1));
+			std::string v;
+			while(std::getline(ss, v, ',')) values[k].push_back(atof(v.c_str()));
+		}
+		else if(0==strcmp(argv[i], "-rand")){
+			n_rand = atoi(argv[++i]);
+		}
+		else if(0==strcmp(argv[i], "-seed")){
+			seed = atoi(argv[++i]);
+		}
+		else if(0==strcmp(argv[i], "-j")){
+			n_jobs = atoi(argv[++i]);
+		}
+		else if(0==strcmp(argv[i], "-t")){
+			n_threads = atoi(argv[++i]);
+		}
+		else if(0==strcmp(argv[i], "-cloff")){
+			b_opencl_off = true;
+		}
+		else if(0==strcmp(argv[i], "-o")){
+			out_dir = argv[++i];
+		}
+		else{
+			printf("unknown option %s\n", argv[i]);
+			exit(-1);
+		}
+	}
+	if(n_jobs <= 0){
+		n_jobs = std::max(1, (int)std::thread::hardware_concurrency() / std::max(1, n_threads));
+	}
+	bool b_sweep = false;
+	for(auto& v : values) b_sweep |= !v.empty();
+	if(!b_sweep){
+		values[TP_VOLUME_DIMS] = {256, 512};
+		values[TP_ICP_ITERATIONS] = {5, 10};
+		values[TP_PYRAMID_LEVELS] = {2, 3};
+		values[TP_RAYCAST_STEP_FACTOR] = {0.25, 0.5};
+	}
+
+	// base params and sequence
+	cv::Ptr<cv::kinfu::Params> base = b_coarse ? cv::kinfu::Params::coarseParams() : cv::kinfu::Params::defaultParams();
+	std::vector<cv::Mat> depths;
+	std::vector<cv::Affine3f> poses;
+	if(!seq_dir.empty()){
+		if(!loadSequence(seq_dir, *base, depths, poses)) exit(-1);
+	}
+	else{
+		base->frameSize = cv::Size(640, 480);
+		base->intr = cv::Matx33f(525.f, 0, 319.5f, 0, 525.f, 239.5f, 0, 0, 1);
+		base->depthFactor = 1000.f;
+		makeSyntheticSequence(*base, nframes, noise, depths, poses);
+	}
+	if(!save_dir.empty() && !saveSequence(save_dir, *base, depths, poses)) exit(-1);
+	if(!kp_file.empty() && !loadKinfuParams(kp_file, *base)) exit(-1);
+	const bool b_drift = !poses.empty() || b_loop;
+
+	// configs
+	std::vector<std::vector<double>> configs;
+	if(n_rand > 0){
+		cv::RNG rng(seed);
+		for(int n=0; n<n_rand; n++){
+			std::vector<double> cfg(TP_NUM, NAN);
+			for(int i=0; i<TP_NUM; i++){
+				if(values[i].empty()) continue;
+				double vmin = *std::min_element(values[i].begin(), values[i].end());
+				double vmax = *std::max_element(values[i].begin(), values[i].end());
+				cfg[i] = TuneParamInt[i] ? rng.uniform((int)vmin, (int)vmax + 1) : rng.uniform(vmin, vmax);
+			}
+			configs.push_back(cfg);
+		}
+	}
+	else{
+		std::vector<size_t> digit(TP_NUM, 0);
+		while(1){
+			std::vector<double> cfg(TP_NUM, NAN);
+			for(int i=0; i<TP_NUM; i++){
+				if(!values[i].empty()) cfg[i] = values[i][digit[i]];
+			}
+			configs.push_back(cfg);
+			int i = 0;
+			for(; i<TP_NUM; i++){
+				if(values[i].empty()) continue;
+				if(++digit[i] < values[i].size()) break;
+				digit[i] = 0;
+			}
+			if(i == TP_NUM) break;
+		}
+	}
+	printf("%d configs, %d processes x %d threads\n", (int)configs.size(), n_jobs, n_threads);
+
+	// run
+	// Each worker is forked before any OpenCV thread pool or OpenCL context exists in this process.
+	std::vector<TUNE_RESULT_T> results(configs.size());
+	for(size_t i=0; i<results.size(); i++){
+		results[i] = {(int)i, false, 0, 0, 0, -1, -1};
+	}
+	printf(" idx    fps   icp_fail drift[m]  final[m]   config\n");
+#ifdef _WIN32
+	cv::setNumThreads(n_threads);
+	if(b_opencl_off) cv::ocl::setUseOpenCL(false);
+	for(size_t i=0; i<configs.size(); i++){
+		results[i] = runTuneConfig((int)i, makeTuneParams(*base, configs[i]), volume_engine, depths, poses, b_loop);
+		printTuneResult(results[i], configs[i]);
+	}
+#else
+	std::vector<int> fds;
+	std::vector<pid_t> pids;
+	for(int w=0; w<n_jobs && w<(int)configs.size(); w++){
+		int fd[2];
+		if(pipe(fd) != 0){
+			perror("pipe");
+			exit(-1);
+		}
+		pid_t pid = fork();
+		if(pid < 0){
+			perror("fork");
+			exit(-1);
+		}
+		if(pid == 0){
+			close(fd[0]);
+			cv::setNumThreads(n_threads);
+			if(b_opencl_off) cv::ocl::setUseOpenCL(false);
+			for(size_t i=w; i<configs.size(); i+=n_jobs){
+				TUNE_RESULT_T r = runTuneConfig((int)i, makeTuneParams(*base, configs[i]), volume_engine, depths, poses, b_loop);
+				if(write(fd[1], &r, sizeof(r)) != (ssize_t)sizeof(r)) break;
+			}
+			close(fd[1]);
+			_exit(0);
+		}
+		close(fd[1]);
+		fds.push_back(fd[0]);
+		pids.push_back(pid);
+	}
+	// print results as soon as any worker sends one, and keep every pipe drained
+	std::vector<struct pollfd> pfds;
+	for(int fd : fds){
+		struct pollfd pfd = {fd, POLLIN, 0};
+		pfds.push_back(pfd);
+	}
+	size_t n_open = pfds.size();
+	while(n_open > 0){
+		if(poll(pfds.data(), pfds.size(), -1) < 0){
+			if(errno == EINTR) continue;
+			perror("poll");
+			break;
+		}
+		for(struct pollfd& pfd : pfds){
+			if(pfd.fd < 0 || !(pfd.revents & (POLLIN | POLLHUP | POLLERR))) continue;
+			TUNE_RESULT_T r;
+			if(read(pfd.fd, &r, sizeof(r)) == (ssize_t)sizeof(r)){
+				results[r.idx] = r;
+				printTuneResult(r, configs[r.idx]);
+			}
+			else{
+				// the worker has finished
+				close(pfd.fd);
+				pfd.fd = -1;
+				n_open--;
+			}
+		}
+	}
+	for(struct pollfd& pfd : pfds){
+		if(pfd.fd >= 0) close(pfd.fd);
+	}
+	for(pid_t pid : pids){
+		waitpid(pid, NULL, 0);
+	}
+#endif
+
+	// pareto front
+	printf("<pareto-optimal configs>\n");
+	int n_pareto = 0;
+	for(size_t i=0; i<results.size(); i++){
+		if(!results[i].b_valid) continue;
+		bool b_dominated = false;
+		for(size_t j=0; j<results.size() && !b_dominated; j++){
+			b_dominated = results[j].b_valid && dominates(results[j], results[i], b_drift);
+		}
+		if(b_dominated) continue;
+		printTuneResult(results[i], configs[i]);
+
+		char name[32];
+		snprintf(name, sizeof(name), "/kinfu_tuned_%02d.yml", n_pareto++);
+		cv::FileStorage fs(out_dir + name, cv::FileStorage::WRITE);
+		if(!fs.isOpened()){
+			fprintf(stderr, "cannot write %s%s\n", out_dir.c_str(), name);
+			continue;
+		}
+		saveKinfuParams(fs, *makeTuneParams(*base, configs[i]));
+		fs << "tune_fps" << results[i].fps;
+		fs << "tune_icp_fail" << results[i].icp_fail;
+		fs << "tune_drift" << results[i].drift;
+		printf("  -> %s%s\n", out_dir.c_str(), name);
+	}
+	return 0;
+}